@@ -83,6 +83,11 @@ int BHwBinder::getMinSchedulingPriority() {
     return mSchedPriority;
 }
 
+void BHwBinder::setMinSchedulerPolicy(int policy, int priority) {
+    mSchedPolicy = policy;
+    mSchedPriority = priority;
+}
+
 bool BHwBinder::isRequestingSid() {
     Extras* e = mExtras.load(std::memory_order_acquire);
 
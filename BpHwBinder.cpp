@@ -21,9 +21,14 @@
 
 #include <hwbinder/IPCThreadState.h>
 #include <utils/Log.h>
+#include <utils/String8.h>
 
 #include <stdio.h>
 
+#include <atomic>
+#include <deque>
+#include <memory>
+
 //#undef ALOGV
 //#define ALOGV(...) fprintf(stderr, __VA_ARGS__)
 
@@ -32,6 +37,106 @@ namespace hardware {
 
 // ---------------------------------------------------------------------------
 
+namespace {
+
+// Runs queued tasks on up to mMaxThreads threads, started as tasks arrive.
+// Threads stay around once started and wait for more work.
+class TaskPool
+{
+public:
+    TaskPool(const char* name, size_t maxThreads)
+        : mName(name), mMaxThreads(maxThreads), mThreads(0), mIdle(0)
+    {
+    }
+
+    void setMaxThreads(size_t maxThreads)
+    {
+        AutoMutex _l(mLock);
+        mMaxThreads = maxThreads > 0 ? maxThreads : 1;
+    }
+
+    void post(std::function<void()>&& task)
+    {
+        AutoMutex _l(mLock);
+        mTasks.push_back(std::move(task));
+        if (mIdle > 0 || mThreads >= mMaxThreads) {
+            mCond.signal();
+            return;
+        }
+        sp<Thread> t = new Worker(this);
+        if (t->run(String8::format("%s:%zu", mName, mThreads).string()) == NO_ERROR) {
+            mThreads++;
+        } else if (mThreads == 0) {
+            ALOGE("Failed to start %s thread; running task inline", mName);
+            std::function<void()> inlineTask = std::move(mTasks.back());
+            mTasks.pop_back();
+            mLock.unlock();
+            inlineTask();
+            mLock.lock();
+        }
+    }
+
+private:
+    class Worker : public Thread
+    {
+    public:
+        explicit Worker(TaskPool* pool) : mPool(pool) {}
+
+    protected:
+        virtual bool threadLoop()
+        {
+            mPool->runOne();
+            return true;
+        }
+
+        TaskPool* const mPool;
+    };
+
+    void runOne()
+    {
+        std::function<void()> task;
+        {
+            AutoMutex _l(mLock);
+            while (mTasks.empty()) {
+                mIdle++;
+                mCond.wait(mLock);
+                mIdle--;
+            }
+            task = std::move(mTasks.front());
+            mTasks.pop_front();
+        }
+        task();
+    }
+
+    const char*                         mName;
+    Mutex                               mLock;
+    Condition                           mCond;
+    std::deque<std::function<void()>>   mTasks;
+    size_t                              mMaxThreads;
+    size_t                              mThreads;
+    size_t                              mIdle;
+};
+
+// Never destroyed: dispatcher threads may still be running at exit.
+TaskPool& asyncDispatcher()
+{
+    static TaskPool* sPool = new TaskPool("HwBinderAsync", 4);
+    return *sPool;
+}
+
+// Zero while obituaries are delivered inline.
+std::atomic<size_t> gObituaryThreads(0);
+
+TaskPool& obituaryDispatcher()
+{
+    static TaskPool* sPool = new TaskPool("HwBinderDeath", 1);
+    return *sPool;
+}
+
+} // namespace
+
+// ---------------------------------------------------------------------------
+
 BpHwBinder::ObjectManager::ObjectManager()
 {
 }
@@ -118,6 +223,47 @@ status_t BpHwBinder::transact(
     return DEAD_OBJECT;
 }
 
+void BpHwBinder::reserveData(uint32_t code, Parcel* data) const
+{
+    IPCThreadState::self()->reserveTransactionData(mHandle, code, data);
+}
+
+status_t BpHwBinder::transactAsync(
+    uint32_t code, const Parcel& data, AsyncCallback callback, uint32_t flags)
+{
+    if (flags & FLAG_ONEWAY) return BAD_VALUE;
+    if (!mAlive) return DEAD_OBJECT;
+
+    std::shared_ptr<Parcel> request = std::make_shared<Parcel>();
+    status_t err = request->copyFrom(data);
+    if (err != NO_ERROR) return err;
+
+    sp<BpHwBinder> self(this);
+    asyncDispatcher().post([self, code, request, callback, flags]() {
+        Parcel reply;
+        status_t status = self->transact(code, *request, &reply, flags);
+        // Drop the copy, and the objects it holds, before calling back.
+        request->freeData();
+        if (callback != nullptr) {
+            callback(status, reply);
+        }
+    });
+    return NO_ERROR;
+}
+
+void BpHwBinder::setAsyncDispatcherThreads(size_t maxThreads)
+{
+    asyncDispatcher().setMaxThreads(maxThreads);
+}
+
+void BpHwBinder::setObituaryDispatchThreads(size_t maxThreads)
+{
+    if (maxThreads > 0) {
+        obituaryDispatcher().setMaxThreads(maxThreads);
+    }
+    gObituaryThreads.store(maxThreads, std::memory_order_relaxed);
+}
+
 status_t BpHwBinder::linkToDeath(
     const sp<DeathRecipient>& recipient, void* cookie, uint32_t flags)
 {
@@ -142,7 +288,7 @@ status_t BpHwBinder::linkToDeath(
                 getWeakRefs()->incWeak(this);
                 IPCThreadState* self = IPCThreadState::self();
                 self->requestDeathNotification(mHandle, this);
-                self->flushCommands();
+                self->flushDeathNotifications();
             }
             ssize_t res = mObituaries->add(ob);
             return res >= (ssize_t)NO_ERROR ? (status_t)NO_ERROR : res;
@@ -176,7 +322,7 @@ status_t BpHwBinder::unlinkToDeath(
                 ALOGV("Clearing death notification: %p handle %d\n", this, mHandle);
                 IPCThreadState* self = IPCThreadState::self();
                 self->clearDeathNotification(mHandle, this);
-                self->flushCommands();
+                self->flushDeathNotifications();
                 delete mObituaries;
                 mObituaries = nullptr;
             }
@@ -212,8 +358,21 @@ void BpHwBinder::sendObituary()
 
     if (obits != nullptr) {
         const size_t N = obits->size();
-        for (size_t i=0; i<N; i++) {
-            reportOneDeath(obits->itemAt(i));
+        if (gObituaryThreads.load(std::memory_order_relaxed) > 0) {
+            // The driver keeps its weak reference on this proxy until it has
+            // cleared the notification, so the tasks can take their own.
+            const wp<IBinder> who(this);
+            for (size_t i=0; i<N; i++) {
+                const wp<DeathRecipient> recipient = obits->itemAt(i).recipient;
+                obituaryDispatcher().post([who, recipient]() {
+                    sp<DeathRecipient> r = recipient.promote();
+                    if (r != nullptr) r->binderDied(who);
+                });
+            }
+        } else {
+            for (size_t i=0; i<N; i++) {
+                reportOneDeath(obits->itemAt(i));
+            }
         }
 
         delete obits;
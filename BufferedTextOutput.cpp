@@ -95,18 +95,25 @@ struct BufferedTextOutput::ThreadState
 static pthread_mutex_t gMutex = PTHREAD_MUTEX_INITIALIZER;
 
 static thread_store_t   tls;
+// Cached copy of the tls value; tls is kept for its destructor.
+static thread_local void* gThreadState = nullptr;
 
 BufferedTextOutput::ThreadState* BufferedTextOutput::getThreadState()
 {
-    ThreadState*  ts = (ThreadState*) thread_store_get( &tls );
+    ThreadState*  ts = (ThreadState*) gThreadState;
     if (ts) return ts;
-    ts = new ThreadState;
-    thread_store_set( &tls, ts, threadDestructor );
+    ts = (ThreadState*) thread_store_get( &tls );
+    if (ts == nullptr) {
+        ts = new ThreadState;
+        thread_store_set( &tls, ts, threadDestructor );
+    }
+    gThreadState = ts;
     return ts;
 }
 
 void BufferedTextOutput::threadDestructor(void *st)
 {
+    if (gThreadState == st) gThreadState = nullptr;
     delete ((ThreadState*)st);
 }
 
@@ -19,6 +19,7 @@
 
 #include <utils/misc.h>
 
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -309,6 +310,42 @@ ssize_t getHWBinderKernelReferences(size_t count, uintptr_t* buf) {
     return proc->getKernelReferences(count, buf);
 }
 
+void printThreadPoolStats(debugPrintFunc func, void* cookie)
+{
+    if (func == nullptr) func = defaultPrintFunc;
+
+    sp<ProcessState> proc = ProcessState::selfOrNull();
+    if (proc.get() == nullptr) {
+        func(cookie, "No binder thread pool.\n");
+        return;
+    }
+
+    const ProcessState::ThreadPoolStats stats = proc->getThreadPoolStats();
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "Binder thread pool: %zu executing, %zu peak, %zu max, %.2f average over %" PRIu64
+             " ms\n",
+             stats.executingThreads, stats.peakExecutingThreads, stats.maxThreads,
+             stats.averageExecutingThreads, stats.profileNs / 1000000);
+    func(cookie, buf);
+    snprintf(buf, sizeof(buf),
+             "  %" PRIu64 " commands, busy %" PRIu64 " ms, idle %" PRIu64 " ms, queued %" PRIu64
+             " us (max %" PRIu64 " us)\n",
+             stats.commands, stats.busyNs / 1000000, stats.idleNs / 1000000,
+             stats.queueingNs / 1000, stats.maxQueueingNs / 1000);
+    func(cookie, buf);
+    snprintf(buf, sizeof(buf),
+             "  starved %" PRIu64 " times for %" PRIu64 " ms (longest %" PRIu64 " ms)\n",
+             stats.starvationCount, stats.starvationMs, stats.longestStarvationMs);
+    func(cookie, buf);
+    for (const ProcessState::PoolThreadStats& thread : stats.threads) {
+        snprintf(buf, sizeof(buf),
+                 "  thread %d: %" PRIu64 " commands, busy %" PRIu64 " ms, idle %" PRIu64 " ms\n",
+                 thread.tid, thread.commands, thread.busyNs / 1000000, thread.idleNs / 1000000);
+        func(cookie, buf);
+    }
+}
+
 } // namespace hardware
 } // namespace android
 
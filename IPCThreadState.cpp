@@ -21,23 +21,30 @@
 #include <hwbinder/Binder.h>
 #include <hwbinder/BpHwBinder.h>
 #include <hwbinder/TextOutput.h>
+#include <hwbinder/TransactionRecorder.h>
 
 #include <android-base/macros.h>
 #include <utils/CallStack.h>
 #include <utils/Log.h>
 #include <utils/SystemClock.h>
+#include <utils/Timers.h>
 #include <utils/threads.h>
 
 #include "binder_kernel.h"
 #include <hwbinder/Static.h>
 
+#include <algorithm>
 #include <atomic>
+#include <new>
+#include <optional>
 #include <errno.h>
 #include <inttypes.h>
 #include <linux/sched.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/resource.h>
 #include <unistd.h>
@@ -67,6 +74,128 @@
 namespace android {
 namespace hardware {
 
+// Upper bound on the number of oneway transactions queued by a batch before
+// they are submitted; their completions must fit in the read buffer.
+static const size_t kMaxOnewayBatchSize = 32;
+
+// Estimates how much of the receive mapping a buffer from the driver takes:
+// the data, the offsets array after it, and the scatter-gather buffers after
+// that, each 8-byte aligned.
+static size_t receivedBufferSize(const uint8_t* data, size_t dataSize,
+                                 const binder_size_t* objects, size_t objectsCount)
+{
+    auto alignUp = [](uintptr_t v) { return (v + 7) & ~(uintptr_t)7; };
+    const uintptr_t start = reinterpret_cast<uintptr_t>(data);
+    uintptr_t end = alignUp(start + dataSize);
+    if (objectsCount > 0) {
+        end = std::max(end, alignUp(reinterpret_cast<uintptr_t>(objects) +
+                                    objectsCount * sizeof(binder_size_t)));
+    }
+    for (size_t i = 0; i < objectsCount; i++) {
+        if (objects[i] + sizeof(binder_buffer_object) > dataSize) continue;
+        const binder_buffer_object* obj =
+                reinterpret_cast<const binder_buffer_object*>(data + objects[i]);
+        if (obj->hdr.type != BINDER_TYPE_PTR) continue;
+        end = std::max(end, alignUp(obj->buffer + obj->length));
+    }
+    return end - start;
+}
+
+// Updates a counter that only the calling thread writes, but others read.
+static inline void addRelaxed(std::atomic<uint64_t>& counter, uint64_t delta)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+// Raises the calling thread to a node's minimum scheduling policy for the
+// duration of a transaction on it, unless it already runs at least that
+// high, and puts it back afterwards. Sending a reply has the driver restore
+// the thread's own priority, in which case the thread is no longer at the
+// raised setting and is left as it is.
+class ScopedMinScheduling {
+public:
+    explicit ScopedMinScheduling(BHwBinder* binder);
+    ~ScopedMinScheduling();
+
+private:
+    bool                isStillRaised() const;
+
+    bool                mRaised;
+    bool                mPolicyChanged;
+    int                 mPolicy;    // including SCHED_RESET_ON_FORK
+    struct sched_param  mParam;
+    int                 mNice;
+    int                 mRaisedPolicy;
+    int                 mRaisedPriority;
+};
+
+ScopedMinScheduling::ScopedMinScheduling(BHwBinder* binder)
+    : mRaised(false), mPolicyChanged(false), mPolicy(SCHED_NORMAL), mParam(), mNice(0),
+      mRaisedPolicy(SCHED_NORMAL), mRaisedPriority(0)
+{
+    if (binder == nullptr) return;
+    const int minPolicy = binder->getMinSchedulingPolicy();
+    const int minPriority = binder->getMinSchedulingPriority();
+    if (minPolicy == SCHED_NORMAL && minPriority == 0) {
+        // No minimum requested.
+        return;
+    }
+
+    mPolicy = sched_getscheduler(0);
+    if (mPolicy < 0 || sched_getparam(0, &mParam) != 0) return;
+    mNice = getpriority(PRIO_PROCESS, 0);
+
+    const int policy = mPolicy & ~SCHED_RESET_ON_FORK;
+    const bool isRt = policy == SCHED_FIFO || policy == SCHED_RR;
+    if (minPolicy == SCHED_FIFO || minPolicy == SCHED_RR) {
+        if (isRt && mParam.sched_priority >= minPriority) return;
+        struct sched_param param = { .sched_priority = minPriority };
+        if (sched_setscheduler(0, minPolicy | SCHED_RESET_ON_FORK, &param) != 0) {
+            ALOGW("Failed to raise binder thread to policy %d priority %d: %s",
+                  minPolicy, minPriority, strerror(errno));
+            return;
+        }
+        mPolicyChanged = true;
+        mRaisedPolicy = minPolicy;
+    } else {
+        if (isRt || mNice <= minPriority) return;
+        if (setpriority(PRIO_PROCESS, 0, minPriority) != 0) {
+            ALOGW("Failed to raise binder thread to nice %d: %s", minPriority,
+                  strerror(errno));
+            return;
+        }
+    }
+    mRaisedPriority = minPriority;
+    mRaised = true;
+}
+
+bool ScopedMinScheduling::isStillRaised() const
+{
+    const int policy = sched_getscheduler(0);
+    if (policy < 0) return false;
+    const int basePolicy = policy & ~SCHED_RESET_ON_FORK;
+    if (mPolicyChanged) {
+        struct sched_param param;
+        return basePolicy == mRaisedPolicy && sched_getparam(0, &param) == 0 &&
+                param.sched_priority == mRaisedPriority;
+    }
+    if (basePolicy == SCHED_FIFO || basePolicy == SCHED_RR) return false;
+    errno = 0;
+    const int nice = getpriority(PRIO_PROCESS, 0);
+    return errno == 0 && nice == mRaisedPriority;
+}
+
+ScopedMinScheduling::~ScopedMinScheduling()
+{
+    if (!mRaised || !isStillRaised()) return;
+    if (mPolicyChanged && sched_setscheduler(0, mPolicy, &mParam) != 0) {
+        ALOGW("Failed to restore binder thread policy %d: %s", mPolicy, strerror(errno));
+    }
+    if (!mPolicyChanged && setpriority(PRIO_PROCESS, 0, mNice) != 0) {
+        ALOGW("Failed to restore binder thread nice %d: %s", mNice, strerror(errno));
+    }
+}
+
 // Static const and functions will be optimized out if not used,
 // when LOG_NDEBUG and references in IF_LOG_COMMANDS() are optimized out.
 static const char *kReturnStrings[] = {
@@ -274,13 +403,273 @@ static const void* printCommand(TextOutput& out, const void* _cmd)
     return cmd;
 }
 
+// ---------------------------------------------------------------------------
+// Deferred command logging; see IPCThreadState::setCommandLogging().
+
+std::atomic<size_t> IPCThreadState::sCommandLogSize(0);
+
+static const size_t kMinCommandLogSize = 4096;
+// Bytes of the data of an outgoing transaction kept with its record.
+static const size_t kLoggedTransactionBytes = 64;
+
+// Records are 8-byte aligned, may wrap around the end of the ring, and end
+// with their total size, so a reader can walk back from the write position
+// to the oldest record not yet overwritten. Only the owning thread writes
+// to a ring; readers copy it and drop whatever was overwritten meanwhile.
+struct IPCThreadState::CommandLog {
+    enum Kind : uint32_t {
+        SENT,           // write buffer handed to the driver
+        RECEIVED,       // read buffer filled in by the driver
+        TRANSACTION,    // start of the data of a transaction being sent
+    };
+
+    struct RecordHeader {
+        int64_t         timeNs;
+        uint32_t        kind;
+        uint32_t        length;     // of the bytes logged
+        uint32_t        stored;     // of those, how many follow the header
+        int32_t         handle;
+        uint32_t        code;
+        uint32_t        flags;
+    };
+
+    static constexpr size_t kAlignment = 8;
+    static constexpr size_t kTrailerSize = sizeof(uint64_t);
+
+    CommandLog(size_t ringSize, pid_t owner)
+        : ring(new uint8_t[ringSize]), size(ringSize), writePos(0), tid(owner), live(true) {}
+
+    size_t maxStored() const { return size / 4; }
+
+    static void copyFromRing(const uint8_t* ring, size_t size, uint64_t pos,
+                             void* dst, size_t len) {
+        const size_t offset = pos % size;
+        const size_t first = std::min(len, size - offset);
+        memcpy(dst, ring + offset, first);
+        memcpy((uint8_t*)dst + first, ring, len - first);
+    }
+
+    void copyToRing(uint64_t pos, const void* src, size_t len) {
+        const size_t offset = pos % size;
+        const size_t first = std::min(len, size - offset);
+        memcpy(ring.get() + offset, src, first);
+        memcpy(ring.get(), (const uint8_t*)src + first, len - first);
+    }
+
+    static uint64_t recordSize(size_t stored) {
+        return sizeof(RecordHeader) + ((stored + kAlignment - 1) & ~(kAlignment - 1)) +
+                kTrailerSize;
+    }
+
+    void append(const RecordHeader& hdr, const void* data) {
+        const uint64_t total = recordSize(hdr.stored);
+        const uint64_t pos = writePos.load(std::memory_order_relaxed);
+        copyToRing(pos, &hdr, sizeof(hdr));
+        copyToRing(pos + sizeof(hdr), data, hdr.stored);
+        copyToRing(pos + total - kTrailerSize, &total, kTrailerSize);
+        writePos.store(pos + total, std::memory_order_release);
+    }
+
+    void dump(TextOutput& out, int64_t nowNs) const;
+
+    static CommandLog*  acquire(CommandLog* previous, size_t ringSize);
+    static void         release(CommandLog* log);
+
+    const std::unique_ptr<uint8_t[]> ring;
+    const size_t        size;
+    std::atomic<uint64_t> writePos;
+    // Guarded by sLock, like sLogs.
+    pid_t               tid;
+    bool                live;
+
+    static Mutex        sLock;
+    // Logs of live threads and of exited ones, which new threads reuse.
+    static std::vector<CommandLog*> sLogs;
+};
+
+Mutex IPCThreadState::CommandLog::sLock;
+std::vector<IPCThreadState::CommandLog*> IPCThreadState::CommandLog::sLogs;
+
+// Prints a buffer of commands, stepping by the size encoded in each command
+// rather than trusting the printer, which skips the _SG variants' payload.
+static void printCommands(TextOutput& out, const uint8_t* cmds, size_t size,
+                          const void* (*print)(TextOutput&, const void*))
+{
+    size_t pos = 0;
+    while (pos + sizeof(uint32_t) <= size) {
+        uint32_t code;
+        memcpy(&code, cmds + pos, sizeof(code));
+        const size_t next = pos + sizeof(uint32_t) + _IOC_SIZE(code);
+        if (next > size) {
+            out << "(truncated)" << endl;
+            break;
+        }
+        print(out, cmds + pos);
+        pos = next;
+    }
+}
+
+void IPCThreadState::CommandLog::dump(TextOutput& out, int64_t nowNs) const
+{
+    std::unique_ptr<uint8_t[]> snapshot(new uint8_t[size]);
+    const uint64_t end = writePos.load(std::memory_order_acquire);
+    memcpy(snapshot.get(), ring.get(), size);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    // Anything below this may have been overwritten while it was copied,
+    // including by a record the writer had started but not yet published.
+    const uint64_t reach = writePos.load(std::memory_order_relaxed) + recordSize(maxStored());
+    const uint64_t low = reach > size ? reach - size : 0;
+
+    std::vector<uint64_t> starts;
+    uint64_t pos = end;
+    while (pos >= low + recordSize(0)) {
+        uint64_t total;
+        copyFromRing(snapshot.get(), size, pos - kTrailerSize, &total, sizeof(total));
+        if (total < recordSize(0) || total > pos - low) break;
+        RecordHeader hdr;
+        copyFromRing(snapshot.get(), size, pos - total, &hdr, sizeof(hdr));
+        if (hdr.kind > TRANSACTION || hdr.stored > maxStored() || hdr.stored > hdr.length ||
+            recordSize(hdr.stored) != total) {
+            break;
+        }
+        pos -= total;
+        starts.push_back(pos);
+    }
+
+    out << "Thread " << tid << (live ? "" : " (exited)") << ": " << starts.size()
+        << " records" << endl << indent;
+    std::vector<uint64_t> payload;
+    for (auto it = starts.rbegin(); it != starts.rend(); ++it) {
+        RecordHeader hdr;
+        copyFromRing(snapshot.get(), size, *it, &hdr, sizeof(hdr));
+        payload.resize((hdr.stored + kAlignment - 1) / kAlignment);
+        copyFromRing(snapshot.get(), size, *it + sizeof(hdr), payload.data(), hdr.stored);
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(payload.data());
+
+        out << "-" << (nowNs - hdr.timeNs) / 1000 << " us: ";
+        switch (hdr.kind) {
+            case SENT:
+            case RECEIVED:
+                out << (hdr.kind == SENT ? "Sent commands to driver" :
+                                           "Received commands from driver");
+                if (hdr.stored < hdr.length) {
+                    out << " (first " << hdr.stored << " of " << hdr.length << " bytes)";
+                }
+                out << ": " << indent << HexDump(bytes, hdr.stored) << endl;
+                printCommands(out, bytes, hdr.stored,
+                              hdr.kind == SENT ? printCommand : printReturnCommand);
+                out << dedent;
+                break;
+            case TRANSACTION:
+                out << "BC_TRANSACTION hand " << hdr.handle << " / code "
+                    << TypeCode(hdr.code) << " / flags " << (void*)(long)hdr.flags
+                    << ", " << hdr.length << " bytes: " << indent
+                    << HexDump(bytes, hdr.stored) << endl << dedent;
+                break;
+            default:
+                out << "Unknown record " << hdr.kind << endl;
+                break;
+        }
+    }
+    out << dedent;
+}
+
+IPCThreadState::CommandLog* IPCThreadState::CommandLog::acquire(CommandLog* previous,
+                                                                size_t ringSize)
+{
+    AutoMutex _l(sLock);
+    if (previous != nullptr) previous->live = false;
+
+    // Logs of another size cannot be reused, so drop the exited ones.
+    CommandLog* reusable = nullptr;
+    for (auto it = sLogs.begin(); it != sLogs.end();) {
+        CommandLog* log = *it;
+        if (!log->live && log->size != ringSize) {
+            delete log;
+            it = sLogs.erase(it);
+            continue;
+        }
+        if (!log->live && reusable == nullptr) reusable = log;
+        ++it;
+    }
+
+    const pid_t tid = gettid();
+    if (reusable != nullptr) {
+        reusable->writePos.store(0, std::memory_order_relaxed);
+        reusable->tid = tid;
+        reusable->live = true;
+        return reusable;
+    }
+    CommandLog* log = new CommandLog(ringSize, tid);
+    sLogs.push_back(log);
+    return log;
+}
+
+void IPCThreadState::CommandLog::release(CommandLog* log)
+{
+    AutoMutex _l(sLock);
+    log->live = false;
+}
+
+void IPCThreadState::setCommandLogging(size_t ringSize)
+{
+    if (ringSize != 0) {
+        ringSize = std::max(ringSize, kMinCommandLogSize);
+        ringSize = (ringSize + CommandLog::kAlignment - 1) & ~(CommandLog::kAlignment - 1);
+    }
+    sCommandLogSize.store(ringSize, std::memory_order_relaxed);
+}
+
+void IPCThreadState::dumpCommandLogs(TextOutput& out)
+{
+    const int64_t nowNs = systemTime(SYSTEM_TIME_MONOTONIC);
+    AutoMutex _l(CommandLog::sLock);
+    if (CommandLog::sLogs.empty()) {
+        out << "No binder commands logged." << endl;
+        return;
+    }
+    for (const CommandLog* log : CommandLog::sLogs) {
+        log->dump(out, nowNs);
+    }
+}
+
+void IPCThreadState::logCommand(uint32_t kind, const void* data, size_t size,
+                                int32_t handle, uint32_t code, uint32_t flags)
+{
+    const size_t ringSize = sCommandLogSize.load(std::memory_order_relaxed);
+    if (ringSize == 0) return;
+    if (UNLIKELY(mCommandLog == nullptr || mCommandLog->size != ringSize)) {
+        mCommandLog = CommandLog::acquire(mCommandLog, ringSize);
+    }
+
+    const size_t limit = kind == CommandLog::TRANSACTION
+            ? kLoggedTransactionBytes : mCommandLog->maxStored();
+    CommandLog::RecordHeader hdr;
+    hdr.timeNs = systemTime(SYSTEM_TIME_MONOTONIC);
+    hdr.kind = kind;
+    hdr.length = (uint32_t)size;
+    hdr.stored = (uint32_t)std::min(size, limit);
+    hdr.handle = handle;
+    hdr.code = code;
+    hdr.flags = flags;
+    mCommandLog->append(hdr, data);
+}
+
 static pthread_mutex_t gTLSMutex = PTHREAD_MUTEX_INITIALIZER;
 static std::atomic<bool> gHaveTLS = false;
 static pthread_key_t gTLS = 0;
 static std::atomic<bool> gShutdown = false;
+// Mirrors the gTLS value of the calling thread, which is cheaper to read.
+// gTLS is still what gets threadDestructor() run at thread exit.
+static thread_local IPCThreadState* gThreadState = nullptr;
 
 IPCThreadState* IPCThreadState::self()
 {
+    IPCThreadState* const cached = gThreadState;
+    if (LIKELY(cached != nullptr) && !gShutdown.load(std::memory_order_relaxed)) {
+        return cached;
+    }
+
     if (gHaveTLS.load(std::memory_order_acquire)) {
 restart:
         const pthread_key_t k = gTLS;
@@ -312,6 +701,11 @@ restart:
 
 IPCThreadState* IPCThreadState::selfOrNull()
 {
+    IPCThreadState* const cached = gThreadState;
+    if (LIKELY(cached != nullptr) && !gShutdown.load(std::memory_order_relaxed)) {
+        return cached;
+    }
+
     if (gHaveTLS.load(std::memory_order_acquire)) {
         const pthread_key_t k = gTLS;
         IPCThreadState* st = (IPCThreadState*)pthread_getspecific(k);
@@ -350,59 +744,59 @@ status_t IPCThreadState::clearLastError()
 
 pid_t IPCThreadState::getCallingPid() const
 {
-    return mCallingPid;
+    return mCalling.pid;
 }
 
 const char* IPCThreadState::getCallingSid() const
 {
-    return mCallingSid;
+    return mCalling.sid;
 }
 
 uid_t IPCThreadState::getCallingUid() const
 {
-    return mCallingUid;
+    return mCalling.uid;
 }
 
 int64_t IPCThreadState::clearCallingIdentity()
 {
-    // ignore mCallingSid for legacy reasons
-    int64_t token = ((int64_t)mCallingUid<<32) | mCallingPid;
+    // ignore the calling sid for legacy reasons
+    int64_t token = ((int64_t)mCalling.uid<<32) | mCalling.pid;
     clearCaller();
     return token;
 }
 
 void IPCThreadState::setStrictModePolicy(int32_t policy)
 {
-    mStrictModePolicy = policy;
+    mCalling.strictModePolicy = policy;
 }
 
 int32_t IPCThreadState::getStrictModePolicy() const
 {
-    return mStrictModePolicy;
+    return mCalling.strictModePolicy;
 }
 
 void IPCThreadState::setLastTransactionBinderFlags(int32_t flags)
 {
-    mLastTransactionBinderFlags = flags;
+    mCalling.lastTransactionBinderFlags = flags;
 }
 
 int32_t IPCThreadState::getLastTransactionBinderFlags() const
 {
-    return mLastTransactionBinderFlags;
+    return mCalling.lastTransactionBinderFlags;
 }
 
 void IPCThreadState::restoreCallingIdentity(int64_t token)
 {
-    mCallingUid = (int)(token>>32);
-    mCallingSid = nullptr;  // not enough data to restore
-    mCallingPid = (int)token;
+    mCalling.uid = (int)(token>>32);
+    mCalling.sid = nullptr;  // not enough data to restore
+    mCalling.pid = (int)token;
 }
 
 void IPCThreadState::clearCaller()
 {
-    mCallingPid = getpid();
-    mCallingSid = nullptr;  // expensive to lookup
-    mCallingUid = getuid();
+    mCalling.pid = getpid();
+    mCalling.sid = nullptr;  // expensive to lookup
+    mCalling.uid = getuid();
 }
 
 void IPCThreadState::flushCommands()
@@ -421,11 +815,55 @@ void IPCThreadState::flushCommands()
     }
 }
 
+void IPCThreadState::flushFreedBuffers()
+{
+    if (mOnewayBatchDepth > 0) return;
+    flushCommands();
+}
+
+void IPCThreadState::scheduleFreeFlush(size_t freedSize)
+{
+    // Don't send an open oneway batch early; the free goes out with it.
+    if (mOnewayBatchDepth > 0 || mFreeFlushPending) return;
+
+    const size_t immediateBytes = mProcess->mImmediateFreeBytes.load(std::memory_order_relaxed);
+    const size_t maxBatched = mProcess->mMaxBatchedFrees.load(std::memory_order_relaxed);
+    if (immediateBytes != 0 && freedSize >= immediateBytes) {
+        mProcess->mImmediateFreeFlushes.fetch_add(1, std::memory_order_relaxed);
+    } else if (maxBatched != 0 && mQueuedFrees >= maxBatched) {
+        mProcess->mBatchedFreeFlushes.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        return;
+    }
+    // This runs from Parcel destructors, anywhere; the flush itself waits
+    // for flushPendingFrees() at the end of the current command or call.
+    mFreeFlushPending = true;
+}
+
+void IPCThreadState::flushPendingFrees()
+{
+    if (LIKELY(!mFreeFlushPending) || mOnewayBatchDepth > 0) return;
+    mFreeFlushPending = false;
+    if (mOut.dataSize() > 0) flushCommands();
+}
+
 status_t IPCThreadState::getAndExecuteCommand()
 {
     status_t result;
     int32_t cmd;
 
+    // Pool profiling times the wait in the driver, the time the command
+    // then sat in mIn, and its execution; see setThreadPoolProfiling().
+    const bool profile = mIsLooper &&
+            mProcess->mPoolProfiling.load(std::memory_order_relaxed);
+    const bool willRead = mIn.dataPosition() >= mIn.dataSize();
+    const nsecs_t waitStartNs = profile ? systemTime(SYSTEM_TIME_MONOTONIC) : 0;
+
+    if (mIsReapable) {
+        result = waitForWorkOrReap();
+        if (result != NO_ERROR) return result;
+    }
+
     result = talkWithDriver();
     if (result >= NO_ERROR) {
         size_t IN = mIn.dataAvail();
@@ -436,17 +874,49 @@ status_t IPCThreadState::getAndExecuteCommand()
                  << getReturnString(cmd) << endl;
         }
 
+        bool spawn = false;
+        nsecs_t execStartNs = 0;
         pthread_mutex_lock(&mProcess->mThreadCountLock);
+        if (profile) {
+            execStartNs = systemTime(SYSTEM_TIME_MONOTONIC);
+            if (willRead) {
+                addRelaxed(mPoolProfile.idleNs, execStartNs - waitStartNs);
+                mLastReadNs = execStartNs;
+            } else if (mLastReadNs != 0) {
+                mProcess->poolCommandStartingLocked(execStartNs - mLastReadNs);
+            }
+            mProcess->poolOccupancyChangingLocked(execStartNs);
+        }
         mProcess->mExecutingThreadsCount++;
+        mProcess->mPeakExecutingThreads = std::max(mProcess->mPeakExecutingThreads,
+                                                   mProcess->mExecutingThreadsCount);
         if (mProcess->mExecutingThreadsCount >= mProcess->mMaxThreads &&
             mProcess->mMaxThreads > 1 && mProcess->mStarvationStartTimeMs == 0) {
             mProcess->mStarvationStartTimeMs = uptimeMillis();
         }
+        if (mProcess->mAdaptivePool) {
+            spawn = mProcess->adaptiveShouldSpawnLocked();
+        }
         pthread_mutex_unlock(&mProcess->mThreadCountLock);
 
+        if (spawn) {
+            mProcess->spawnPooledThread(false);
+        }
+
         result = executeCommand(cmd);
+        flushPendingFrees();
+
+        nsecs_t execEndNs = 0;
+        if (profile) {
+            execEndNs = systemTime(SYSTEM_TIME_MONOTONIC);
+            addRelaxed(mPoolProfile.busyNs, execEndNs - execStartNs);
+            addRelaxed(mPoolProfile.commands, 1);
+        }
 
         pthread_mutex_lock(&mProcess->mThreadCountLock);
+        if (profile) {
+            mProcess->poolOccupancyChangingLocked(execEndNs);
+        }
         mProcess->mExecutingThreadsCount--;
         if (mProcess->mExecutingThreadsCount < mProcess->mMaxThreads &&
             mProcess->mStarvationStartTimeMs != 0) {
@@ -458,9 +928,12 @@ status_t IPCThreadState::getAndExecuteCommand()
                       mProcess->mMaxThreads, starvationTimeMs,
                       mProcess->mMaxThreads > 1 ? "" : " (may be a false alarm)");
             }
+            mProcess->poolStarvationEndedLocked(starvationTimeMs);
             mProcess->mStarvationStartTimeMs = 0;
         }
         pthread_mutex_unlock(&mProcess->mThreadCountLock);
+    } else if (profile && willRead) {
+        addRelaxed(mPoolProfile.idleNs, systemTime(SYSTEM_TIME_MONOTONIC) - waitStartNs);
     }
 
     if (UNLIKELY(!mPostCommandTasks.empty())) {
@@ -519,16 +992,22 @@ void IPCThreadState::processPostWriteDerefs()
      * New entries shouldn't be added though, so just iterating until empty
      * should be safe.
      */
+    // Take each list as a whole, rather than shifting it down one entry at
+    // a time; it can be long after a burst of proxy churn.
     while (mPostWriteWeakDerefs.size() > 0) {
-        RefBase::weakref_type* refs = mPostWriteWeakDerefs[0];
-        mPostWriteWeakDerefs.removeAt(0);
-        refs->decWeak(mProcess.get());
+        const Vector<RefBase::weakref_type*> refs(mPostWriteWeakDerefs);
+        mPostWriteWeakDerefs.clear();
+        for (size_t i = 0; i < refs.size(); i++) {
+            refs[i]->decWeak(mProcess.get());
+        }
     }
 
     while (mPostWriteStrongDerefs.size() > 0) {
-        RefBase* obj = mPostWriteStrongDerefs[0];
-        mPostWriteStrongDerefs.removeAt(0);
-        obj->decStrong(mProcess.get());
+        const Vector<RefBase*> objs(mPostWriteStrongDerefs);
+        mPostWriteStrongDerefs.clear();
+        for (size_t i = 0; i < objs.size(); i++) {
+            objs[i]->decStrong(mProcess.get());
+        }
     }
 }
 
@@ -536,10 +1015,24 @@ void IPCThreadState::joinThreadPool(bool isMain)
 {
     LOG_THREADPOOL("**** THREAD %p (PID %d) IS JOINING THE THREAD POOL\n", (void*)pthread_self(), getpid());
 
-    mOut.writeInt32(isMain ? BC_ENTER_LOOPER : BC_REGISTER_LOOPER);
+    // In adaptive mode every pool thread is spawned from userspace, so none
+    // of them answers a kernel BR_SPAWN_LOOPER request.
+    const bool adaptive = mProcess->mAdaptivePool;
+    mOut.writeInt32(isMain || adaptive ? BC_ENTER_LOOPER : BC_REGISTER_LOOPER);
+    if (adaptive) {
+        mProcess->adaptiveLooperJoined();
+    }
+
+    mPoolProfile.tid = gettid();
+    mPoolProfile.busyNs.store(0, std::memory_order_relaxed);
+    mPoolProfile.idleNs.store(0, std::memory_order_relaxed);
+    mPoolProfile.commands.store(0, std::memory_order_relaxed);
+    mLastReadNs = 0;
+    mProcess->poolThreadJoined(&mPoolProfile);
 
     status_t result;
     mIsLooper = true;
+    mIsReapable = adaptive && !isMain;
     do {
         processPendingDerefs();
         // now get the next command to be processed, waiting if necessary
@@ -560,17 +1053,54 @@ void IPCThreadState::joinThreadPool(bool isMain)
     LOG_THREADPOOL("**** THREAD %p (PID %d) IS LEAVING THE THREAD POOL err=%d\n",
         (void*)pthread_self(), getpid(), result);
 
+    // A reaped thread was already taken out of the count by tryReapIdleLooper().
+    if (adaptive && result != TIMED_OUT) {
+        mProcess->adaptiveLooperLeft();
+    }
+
+    mProcess->poolThreadLeft(&mPoolProfile);
+
     mOut.writeInt32(BC_EXIT_LOOPER);
     mIsLooper = false;
+    mIsReapable = false;
     talkWithDriver(false);
 }
 
-int IPCThreadState::setupPolling(int* fd)
+status_t IPCThreadState::waitForWorkOrReap()
+{
+    // Commands left over from the last read are handled first.
+    if (mIn.dataPosition() < mIn.dataSize()) return NO_ERROR;
+
+    // Don't sit on queued commands (buffer frees, refcounts) while idle.
+    if (mOut.dataSize() > 0) {
+        status_t result = talkWithDriver(false);
+        if (result < NO_ERROR) return result;
+    }
+
+    struct pollfd pfd = {
+        .fd = mProcess->mDriverFD,
+        .events = POLLIN,
+        .revents = 0,
+    };
+    int ret = TEMP_FAILURE_RETRY(poll(&pfd, 1, mProcess->mIdleTimeoutMs));
+    if (ret < 0) return -errno;
+    if (ret > 0) return NO_ERROR;
+
+    // Timed out with nothing to do; leave unless the pool is at its minimum.
+    return mProcess->tryReapIdleLooper() ? TIMED_OUT : NO_ERROR;
+}
+
+int IPCThreadState::setupPolling(int* fd, size_t readBufferSize)
 {
     if (mProcess->mDriverFD <= 0) {
         return -EBADF;
     }
 
+    if (readBufferSize > mIn.dataCapacity()) {
+        status_t err = mIn.setDataCapacity(readBufferSize);
+        if (err != NO_ERROR) return err;
+    }
+
     // Tells the kernel to not spawn any additional binder threads,
     // as that won't work with polling. Also, the caller is responsible
     // for subsequently calling handlePolledCommands()
@@ -582,13 +1112,30 @@ int IPCThreadState::setupPolling(int* fd)
     return 0;
 }
 
-status_t IPCThreadState::handlePolledCommands()
+status_t IPCThreadState::handlePolledCommands(size_t* serviced, size_t maxReads)
 {
     status_t result;
+    const size_t servicedBefore = mTransactionsServiced;
+
+    for (size_t reads = 1; ; reads++) {
+        do {
+            result = getAndExecuteCommand();
+        } while (mIn.dataPosition() < mIn.dataSize());
+
+        if (result < NO_ERROR || reads >= maxReads) break;
+
+        // Read again right away only if that won't block.
+        struct pollfd pfd = {
+            .fd = mProcess->mDriverFD,
+            .events = POLLIN,
+            .revents = 0,
+        };
+        if (TEMP_FAILURE_RETRY(poll(&pfd, 1, 0)) <= 0) break;
+    }
 
-    do {
-        result = getAndExecuteCommand();
-    } while (mIn.dataPosition() < mIn.dataSize());
+    if (serviced != nullptr) {
+        *serviced = mTransactionsServiced - servicedBefore;
+    }
 
     processPendingDerefs();
     flushCommands();
@@ -618,9 +1165,30 @@ status_t IPCThreadState::transact(int32_t handle,
             << handle << " / code " << TypeCode(code) << ": "
             << indent << data << dedent << endl;
     }
+    if (UNLIKELY(isCommandLogging())) {
+        logCommand(CommandLog::TRANSACTION, data.data(), data.dataSize(), handle, code, flags);
+    }
 
     LOG_ONEWAY(">>>> SEND from pid %d uid %d %s", getpid(), getuid(),
         (flags & TF_ONE_WAY) == 0 ? "READ REPLY" : "ONE WAY");
+
+    if ((flags & TF_ONE_WAY) != 0) {
+        if (mOnewayBatchDepth > 0) {
+            return queueOnewayTransaction(handle, code, data, flags);
+        }
+    } else if (!mOnewayBatch.empty() && !mSubmittingOnewayBatch) {
+        // Collect the completions of the queued oneway transactions first,
+        // so they are not mistaken for part of this call's response. A call
+        // made by a handler while the batch is being submitted leaves that
+        // to the submission in progress.
+        submitOnewayBatch();
+    }
+
+    const bool recordStats = UNLIKELY(TransactionStats::isEnabled());
+    const bool recordCapture = UNLIKELY(TransactionRecorder::isRecording());
+    const int64_t startNs = (recordStats || recordCapture)
+            ? systemTime(SYSTEM_TIME_MONOTONIC) : 0;
+
     err = writeTransactionData(BC_TRANSACTION_SG, flags, handle, code, data, nullptr);
 
     if (err != NO_ERROR) {
@@ -628,6 +1196,9 @@ status_t IPCThreadState::transact(int32_t handle,
         return (mLastError = err);
     }
 
+    recordSizeHint(mRequestSizeHints, (uintptr_t)handle, code,
+                   data.dataSize(), data.objectsCount());
+
     if ((flags & TF_ONE_WAY) == 0) {
         if (UNLIKELY(mCallRestriction != ProcessState::CallRestriction::NONE)) {
             if (mCallRestriction == ProcessState::CallRestriction::ERROR_IF_NOT_ONEWAY) {
@@ -670,14 +1241,149 @@ status_t IPCThreadState::transact(int32_t handle,
         err = waitForResponse(nullptr, nullptr);
     }
 
+    if (recordStats) {
+        recordTransactionStats(TransactionStats::CLIENT, (uintptr_t)handle, code, data,
+                               startNs, reply != nullptr ? reply->dataSize() : 0);
+    }
+    if (recordCapture) {
+        TransactionRecorder::record(TransactionRecorder::OUTGOING, (uint32_t)handle, code,
+                                    flags, data, startNs,
+                                    systemTime(SYSTEM_TIME_MONOTONIC) - startNs, err);
+    }
+
     return err;
 }
 
+void IPCThreadState::recordTransactionStats(TransactionStats::Side side, uintptr_t target,
+                                            uint32_t code, const Parcel& request,
+                                            int64_t startNs, size_t replySize)
+{
+    const int64_t elapsedNs = systemTime(SYSTEM_TIME_MONOTONIC) - startNs;
+    TransactionStatsRecorder* recorder = statsRecorder();
+    if (recorder == nullptr) return;
+    recorder->record(side, target, code, request, (uint64_t)elapsedNs, replySize);
+}
+
+TransactionStatsRecorder* IPCThreadState::statsRecorder()
+{
+    if (mStatsRecorder == nullptr) {
+        mStatsRecorder.reset(new (std::nothrow) TransactionStatsRecorder());
+    }
+    return mStatsRecorder.get();
+}
+
+void IPCThreadState::reserveTransactionData(int32_t handle, uint32_t code, Parcel* data)
+{
+    applySizeHint(mRequestSizeHints, (uintptr_t)handle, code, data);
+}
+
+IPCThreadState::SizeHint& IPCThreadState::sizeHintFor(SizeHint* table, uintptr_t target,
+                                                      uint32_t code)
+{
+    const uint64_t hash = ((uint64_t)target * 0x9E3779B97F4A7C15ull) ^ code;
+    return table[(hash >> 32) % kSizeHintCount];
+}
+
+void IPCThreadState::recordSizeHint(SizeHint* table, uintptr_t target, uint32_t code,
+                                    size_t dataSize, size_t objectsCount)
+{
+    if (dataSize > INT32_MAX) return;
+    SizeHint& hint = sizeHintFor(table, target, code);
+    hint.target = target;
+    hint.code = code;
+    hint.dataSize = (uint32_t)dataSize;
+    hint.objectsCount = objectsCount;
+}
+
+void IPCThreadState::applySizeHint(SizeHint* table, uintptr_t target, uint32_t code,
+                                   Parcel* parcel)
+{
+    const SizeHint& hint = sizeHintFor(table, target, code);
+    if (hint.dataSize == 0 || hint.target != target || hint.code != code) return;
+    // Only a hint; the parcel still grows on demand if this falls short.
+    parcel->reserve(hint.dataSize, hint.objectsCount);
+}
+
+void IPCThreadState::beginOnewayBatch()
+{
+    mOnewayBatchDepth++;
+}
+
+status_t IPCThreadState::flushOnewayBatch()
+{
+    if (mOnewayBatchDepth == 0) {
+        ALOGE("flushOnewayBatch() called without a matching beginOnewayBatch()");
+        return INVALID_OPERATION;
+    }
+    if (--mOnewayBatchDepth > 0) {
+        return NO_ERROR;
+    }
+
+    submitOnewayBatch();
+    if (mDeathNotificationsDeferred) {
+        mDeathNotificationsDeferred = false;
+        flushCommands();
+    }
+    const status_t err = mOnewayBatchError;
+    mOnewayBatchError = NO_ERROR;
+    return err;
+}
+
+status_t IPCThreadState::queueOnewayTransaction(int32_t handle, uint32_t code,
+                                                const Parcel& data, uint32_t flags)
+{
+    // The command only points at the parcel, so it has to stay around until
+    // the batch is submitted; the caller's copy usually does not.
+    std::unique_ptr<Parcel> copy = std::make_unique<Parcel>();
+    status_t err = data.errorCheck();
+    if (err == NO_ERROR) {
+        err = copy->copyFrom(data);
+    }
+    if (err == NO_ERROR) {
+        err = writeTransactionData(BC_TRANSACTION_SG, flags, handle, code, *copy, nullptr);
+    }
+    if (err != NO_ERROR) {
+        return (mLastError = err);
+    }
+
+    mOnewayBatch.push_back(std::move(copy));
+    if (mOnewayBatch.size() >= kMaxOnewayBatchSize && !mSubmittingOnewayBatch) {
+        // Keep all completions within a single read buffer.
+        submitOnewayBatch();
+    }
+    return NO_ERROR;
+}
+
+status_t IPCThreadState::submitOnewayBatch()
+{
+    // Each queued transaction is answered with a BR_TRANSACTION_COMPLETE, or
+    // with a BR_DEAD_REPLY / BR_FAILED_REPLY if it could not be delivered;
+    // they normally all arrive in the read that accompanies the write.
+    mSubmittingOnewayBatch = true;
+    size_t completed = 0;
+    while (completed < mOnewayBatch.size()) {
+        const status_t err = waitForResponse(nullptr, nullptr);
+        if (err != NO_ERROR && mOnewayBatchError == NO_ERROR) {
+            mOnewayBatchError = err;
+        }
+        if (err != NO_ERROR && err != DEAD_OBJECT && err != FAILED_TRANSACTION) {
+            // The commands may not have reached the driver; keep the parcels
+            // they refer to until a later submission gets through.
+            break;
+        }
+        completed++;
+    }
+    // Commands run while waiting may have submitted part of the batch too.
+    completed = std::min(completed, mOnewayBatch.size());
+    mOnewayBatch.erase(mOnewayBatch.begin(), mOnewayBatch.begin() + completed);
+    mSubmittingOnewayBatch = false;
+    return mOnewayBatchError;
+}
+
 void IPCThreadState::incStrongHandle(int32_t handle, BpHwBinder *proxy)
 {
     LOG_REMOTEREFS("IPCThreadState::incStrongHandle(%d)\n", handle);
-    mOut.writeInt32(BC_ACQUIRE);
-    mOut.writeInt32(handle);
+    writeRefCommand(BC_ACQUIRE, handle);
     // Create a temp reference until the driver has handled this command.
     proxy->incStrong(mProcess.get());
     mPostWriteStrongDerefs.push(proxy);
@@ -686,15 +1392,13 @@ void IPCThreadState::incStrongHandle(int32_t handle, BpHwBinder *proxy)
 void IPCThreadState::decStrongHandle(int32_t handle)
 {
     LOG_REMOTEREFS("IPCThreadState::decStrongHandle(%d)\n", handle);
-    mOut.writeInt32(BC_RELEASE);
-    mOut.writeInt32(handle);
+    writeRefCommand(BC_RELEASE, handle);
 }
 
 void IPCThreadState::incWeakHandle(int32_t handle, BpHwBinder *proxy)
 {
     LOG_REMOTEREFS("IPCThreadState::incWeakHandle(%d)\n", handle);
-    mOut.writeInt32(BC_INCREFS);
-    mOut.writeInt32(handle);
+    writeRefCommand(BC_INCREFS, handle);
     // Create a temp reference until the driver has handled this command.
     proxy->getWeakRefs()->incWeak(mProcess.get());
     mPostWriteWeakDerefs.push(proxy->getWeakRefs());
@@ -703,10 +1407,82 @@ void IPCThreadState::incWeakHandle(int32_t handle, BpHwBinder *proxy)
 void IPCThreadState::decWeakHandle(int32_t handle)
 {
     LOG_REMOTEREFS("IPCThreadState::decWeakHandle(%d)\n", handle);
-    mOut.writeInt32(BC_DECREFS);
+    writeRefCommand(BC_DECREFS, handle);
+}
+
+void IPCThreadState::writeRefCommand(int32_t cmd, int32_t handle)
+{
+    mRefCommands.push_back({ mOut.dataPosition(), cmd, handle });
+    mOut.writeInt32(cmd);
     mOut.writeInt32(handle);
 }
 
+void IPCThreadState::coalesceRefCommands()
+{
+    // Group the commands by handle and by strong or weak, keeping their
+    // order within each group. An increment directly followed by a
+    // decrement, or the other way around, leaves the count in the driver
+    // unchanged, so both can go; matching them up like parentheses leaves
+    // only commands of one direction per group.
+    auto isStrong = [](int32_t cmd) { return cmd == BC_ACQUIRE || cmd == BC_RELEASE; };
+    auto isIncrement = [](int32_t cmd) { return cmd == BC_ACQUIRE || cmd == BC_INCREFS; };
+
+    const size_t n = mRefCommands.size();
+    std::vector<uint32_t> order(n);
+    for (size_t i = 0; i < n; i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        const RefCommand& ca = mRefCommands[a];
+        const RefCommand& cb = mRefCommands[b];
+        if (ca.handle != cb.handle) return ca.handle < cb.handle;
+        if (isStrong(ca.cmd) != isStrong(cb.cmd)) return isStrong(ca.cmd);
+        return a < b;
+    });
+
+    std::vector<bool> cancelled(n, false);
+    std::vector<uint32_t> open;
+    size_t cancelledCount = 0;
+    for (size_t i = 0; i < n; i++) {
+        const RefCommand& cmd = mRefCommands[order[i]];
+        if (i > 0) {
+            const RefCommand& prev = mRefCommands[order[i - 1]];
+            if (prev.handle != cmd.handle || isStrong(prev.cmd) != isStrong(cmd.cmd)) {
+                open.clear();
+            }
+        }
+        if (!open.empty() &&
+            isIncrement(mRefCommands[open.back()].cmd) != isIncrement(cmd.cmd)) {
+            cancelled[open.back()] = true;
+            cancelled[order[i]] = true;
+            open.pop_back();
+            cancelledCount += 2;
+        } else {
+            open.push_back(order[i]);
+        }
+    }
+    if (cancelledCount == 0) return;
+
+    // Squeeze the cancelled commands out of mOut.
+    const size_t kCommandSize = 2 * sizeof(int32_t);
+    uint8_t* out = const_cast<uint8_t*>(mOut.data());
+    const size_t size = mOut.dataSize();
+    size_t readPos = 0;
+    size_t writePos = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!cancelled[i]) continue;
+        const size_t offset = mRefCommands[i].offset;
+        memmove(out + writePos, out + readPos, offset - readPos);
+        writePos += offset - readPos;
+        readPos = offset + kCommandSize;
+    }
+    memmove(out + writePos, out + readPos, size - readPos);
+    writePos += size - readPos;
+
+    mOut.setDataSize(writePos);
+    mOut.setDataPosition(writePos);
+    LOG_REMOTEREFS("IPCThreadState::coalesceRefCommands() dropped %zu of %zu\n",
+                   cancelledCount, n);
+}
+
 status_t IPCThreadState::attemptIncStrongHandle(int32_t handle)
 {
 #if HAS_BC_ATTEMPT_ACQUIRE
@@ -755,15 +1531,37 @@ status_t IPCThreadState::clearDeathNotification(int32_t handle, BpHwBinder* prox
     return NO_ERROR;
 }
 
+void IPCThreadState::flushDeathNotifications()
+{
+    if (mOnewayBatchDepth > 0) {
+        mDeathNotificationsDeferred = true;
+        return;
+    }
+    flushCommands();
+}
+
 IPCThreadState::IPCThreadState()
     : mProcess(ProcessState::self()),
-      mServingStackPointer(nullptr),
-      mStrictModePolicy(0),
-      mLastTransactionBinderFlags(0),
+      mCalling(),
       mIsLooper(false),
       mIsPollingThread(false),
-      mCallRestriction(mProcess->mCallRestriction) {
+      mTransactionsServiced(0),
+      mQueuedFrees(0),
+      mFreeFlushPending(false),
+      mIsReapable(false),
+      mCallRestriction(mProcess->mCallRestriction),
+      mOnewayBatchDepth(0),
+      mOnewayBatchError(NO_ERROR),
+      mSubmittingOnewayBatch(false),
+      mDeathNotificationsDeferred(false),
+      mRequestSizeHints(),
+      mReplySizeHints(),
+      mPoolProfile(),
+      mLastReadNs(0),
+      mDispatchParcelsInUse(false),
+      mCommandLog(nullptr) {
     pthread_setspecific(gTLS, this);
+    gThreadState = this;
     clearCaller();
     mIn.setDataCapacity(256);
     mOut.setDataCapacity(256);
@@ -771,6 +1569,12 @@ IPCThreadState::IPCThreadState()
 
 IPCThreadState::~IPCThreadState()
 {
+    if (gThreadState == this) {
+        gThreadState = nullptr;
+    }
+    if (mCommandLog != nullptr) {
+        CommandLog::release(mCommandLog);
+    }
 }
 
 status_t IPCThreadState::sendReply(const Parcel& reply, uint32_t flags)
@@ -811,6 +1615,7 @@ status_t IPCThreadState::waitForResponse(Parcel *reply, status_t *acquireResult)
             goto finish;
 
         case BR_FAILED_REPLY:
+            mProcess->mFailedTransactions.fetch_add(1, std::memory_order_relaxed);
             err = FAILED_TRANSACTION;
             goto finish;
 
@@ -830,6 +1635,11 @@ status_t IPCThreadState::waitForResponse(Parcel *reply, status_t *acquireResult)
                 ALOG_ASSERT(err == NO_ERROR, "Not enough command data for brREPLY");
                 if (err != NO_ERROR) goto finish;
 
+                mProcess->mmapBufferReceived(receivedBufferSize(
+                    reinterpret_cast<const uint8_t*>(tr.data.ptr.buffer), tr.data_size,
+                    reinterpret_cast<const binder_size_t*>(tr.data.ptr.offsets),
+                    tr.offsets_size/sizeof(binder_size_t)));
+
                 if (reply) {
                     if ((tr.flags & TF_STATUS_CODE) == 0) {
                         reply->ipcSetDataReference(
@@ -870,6 +1680,7 @@ finish:
         if (reply) reply->setError(err);
         mLastError = err;
     }
+    flushPendingFrees();
 
     return err;
 }
@@ -888,7 +1699,12 @@ status_t IPCThreadState::talkWithDriver(bool doReceive)
     // We don't want to write anything if we are still reading
     // from data left in the input buffer and the caller
     // has requested to read the next data.
-    const size_t outAvail = (!doReceive || needRead) ? mOut.dataSize() : 0;
+    const bool doWrite = !doReceive || needRead;
+    if (doWrite && !mRefCommands.empty()) {
+        if (mRefCommands.size() > 1) coalesceRefCommands();
+        mRefCommands.clear();
+    }
+    const size_t outAvail = doWrite ? mOut.dataSize() : 0;
 
     bwr.write_size = outAvail;
     bwr.write_buffer = (uintptr_t)mOut.data();
@@ -918,6 +1734,10 @@ status_t IPCThreadState::talkWithDriver(bool doReceive)
     // Return immediately if there is nothing to do.
     if ((bwr.write_size == 0) && (bwr.read_size == 0)) return NO_ERROR;
 
+    if (UNLIKELY(isCommandLogging()) && outAvail != 0) {
+        logCommand(CommandLog::SENT, mOut.data(), outAvail);
+    }
+
     bwr.write_consumed = 0;
     bwr.read_consumed = 0;
     status_t err;
@@ -949,20 +1769,35 @@ status_t IPCThreadState::talkWithDriver(bool doReceive)
 
     if (err >= NO_ERROR) {
         if (bwr.write_consumed > 0) {
-            if (bwr.write_consumed < mOut.dataSize())
-                LOG_ALWAYS_FATAL("Driver did not consume write buffer. "
-                                 "err: %s consumed: %zu of %zu",
-                                 statusToString(err).c_str(),
-                                 (size_t)bwr.write_consumed,
-                                 mOut.dataSize());
-            else {
+            if (bwr.write_consumed < mOut.dataSize()) {
+                if (mOnewayBatch.empty()) {
+                    LOG_ALWAYS_FATAL("Driver did not consume write buffer. "
+                                     "err: %s consumed: %zu of %zu",
+                                     statusToString(err).c_str(),
+                                     (size_t)bwr.write_consumed,
+                                     mOut.dataSize());
+                }
+                // The driver stops at the first transaction of a batch that
+                // fails; keep the remaining commands for the next write, once
+                // the error has been read.
+                const size_t remaining = mOut.dataSize() - bwr.write_consumed;
+                uint8_t* out = const_cast<uint8_t*>(mOut.data());
+                memmove(out, out + bwr.write_consumed, remaining);
+                mOut.setDataSize(remaining);
+                mOut.setDataPosition(remaining);
+            } else {
                 mOut.setDataSize(0);
+                mQueuedFrees = 0;
+                mFreeFlushPending = false;
                 processPostWriteDerefs();
             }
         }
         if (bwr.read_consumed > 0) {
             mIn.setDataSize(bwr.read_consumed);
             mIn.setDataPosition(0);
+            if (UNLIKELY(isCommandLogging())) {
+                logCommand(CommandLog::RECEIVED, mIn.data(), mIn.dataSize());
+            }
         }
         IF_LOG_COMMANDS() {
             alog << "Remaining data size: " << mOut.dataSize() << endl;
@@ -1118,6 +1953,8 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
     case BR_TRANSACTION_SEC_CTX:
     case BR_TRANSACTION:
         {
+            mTransactionsServiced++;
+
             binder_transaction_data_secctx tr_secctx;
             binder_transaction_data& tr = tr_secctx.transaction_data;
 
@@ -1132,33 +1969,64 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
                 "Not enough command data for brTRANSACTION");
             if (result != NO_ERROR) break;
 
-            Parcel buffer;
+            mProcess->mmapBufferReceived(receivedBufferSize(
+                reinterpret_cast<const uint8_t*>(tr.data.ptr.buffer), tr.data_size,
+                reinterpret_cast<const binder_size_t*>(tr.data.ptr.offsets),
+                tr.offsets_size/sizeof(binder_size_t)));
+
+            // The thread's own request and reply parcels keep the capacity
+            // of their buffer caches between transactions; nested incoming
+            // transactions, while those are taken, get parcels of their own.
+            const bool useThreadParcels = !mDispatchParcelsInUse;
+            mDispatchParcelsInUse = true;
+            std::optional<Parcel> localBuffer;
+            if (!useThreadParcels) localBuffer.emplace();
+            Parcel& buffer = useThreadParcels ? mDispatchRequest : *localBuffer;
             buffer.ipcSetDataReference(
                 reinterpret_cast<const uint8_t*>(tr.data.ptr.buffer),
                 tr.data_size,
                 reinterpret_cast<const binder_size_t*>(tr.data.ptr.offsets),
                 tr.offsets_size/sizeof(binder_size_t), freeBuffer, this);
 
-            const void* origServingStackPointer = mServingStackPointer;
-            mServingStackPointer = &origServingStackPointer; // anything on the stack
-
-            const pid_t origPid = mCallingPid;
-            const char* origSid = mCallingSid;
-            const uid_t origUid = mCallingUid;
-            const int32_t origStrictModePolicy = mStrictModePolicy;
-            const int32_t origTransactionBinderFlags = mLastTransactionBinderFlags;
-
-            mCallingPid = tr.sender_pid;
-            mCallingSid = reinterpret_cast<const char*>(tr_secctx.secctx);
-            mCallingUid = tr.sender_euid;
-            mLastTransactionBinderFlags = tr.flags;
+            const CallingState origCalling = mCalling;
+            mCalling.servingStackPointer = &origCalling; // anything on the stack
+            mCalling.pid = tr.sender_pid;
+            mCalling.sid = reinterpret_cast<const char*>(tr_secctx.secctx);
+            mCalling.uid = tr.sender_euid;
+            mCalling.lastTransactionBinderFlags = tr.flags;
 
-            // ALOGI(">>>> TRANSACT from pid %d sid %s uid %d\n", mCallingPid,
-            //    (mCallingSid ? mCallingSid : "<N/A>"), mCallingUid);
+            // ALOGI(">>>> TRANSACT from pid %d sid %s uid %d\n", mCalling.pid,
+            //    (mCalling.sid ? mCalling.sid : "<N/A>"), mCalling.uid);
 
-            Parcel reply;
+            std::optional<Parcel> localReply;
+            if (!useThreadParcels) localReply.emplace();
+            Parcel& reply = useThreadParcels ? mDispatchReply : *localReply;
             status_t error;
-            bool reply_sent = false;
+            ReplyState replyState = { &reply, tr.flags, false, 0, 0 };
+            const bool recordStats = UNLIKELY(TransactionStats::isEnabled());
+            const bool recordCapture = UNLIKELY(TransactionRecorder::isRecording());
+            const int64_t startNs = (recordStats || recordCapture)
+                    ? systemTime(SYSTEM_TIME_MONOTONIC) : 0;
+            // The server may give the request back early with
+            // releaseKernelBufferNow(), so take what the stats and the
+            // capture need from it before dispatching.
+            TransactionStatsRecorder* statsRecorder = nullptr;
+            TransactionStatsRecorder::Slot* statsSlot = nullptr;
+            const size_t requestSize = buffer.dataSize();
+            if (recordStats) {
+                statsRecorder = this->statsRecorder();
+                if (statsRecorder != nullptr) {
+                    statsSlot = statsRecorder->findSlot(TransactionStats::SERVER,
+                                                        (uintptr_t)tr.cookie, tr.code, buffer);
+                }
+            }
+            TransactionRecorder::Record capturedRequest;
+            if (recordCapture) {
+                TransactionRecorder::capture(tr.data.ptr.buffer, tr.data_size,
+                                             tr.data.ptr.offsets,
+                                             tr.offsets_size / sizeof(binder_size_t),
+                                             &capturedRequest);
+            }
             IF_LOG_TRANSACTIONS() {
                 alog << "BR_TRANSACTION thr " << (void*)pthread_self()
                     << " / obj " << tr.target.ptr << " / code "
@@ -1170,14 +2038,18 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
                     << reinterpret_cast<const size_t*>(tr.data.ptr.offsets) << endl;
             }
 
-            auto reply_callback = [&] (auto &replyParcel) {
-                if (reply_sent) {
+            // Captures two pointers only, so that it fits in the inline
+            // storage of the TransactCallback rather than being allocated.
+            auto reply_callback = [state = &replyState, this] (Parcel& replyParcel) {
+                if (state->sent) {
                     // Reply was sent earlier, ignore it.
                     ALOGE("Dropping binder reply, it was sent already.");
                     return;
                 }
-                reply_sent = true;
-                if ((tr.flags & TF_ONE_WAY) == 0) {
+                state->sent = true;
+                state->size = replyParcel.dataSize();
+                state->objects = replyParcel.objectsCount();
+                if ((state->flags & TF_ONE_WAY) == 0) {
                     replyParcel.setError(NO_ERROR);
                     sendReply(replyParcel, 0);
                 } else {
@@ -1185,28 +2057,41 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
                 }
             };
 
+            if ((tr.flags & TF_ONE_WAY) == 0) {
+                applySizeHint(mReplySizeHints, (uintptr_t)tr.cookie, tr.code, &reply);
+            }
+
             if (tr.target.ptr) {
                 // We only have a weak reference on the target object, so we must first try to
                 // safely acquire a strong reference before doing anything else with it.
                 if (reinterpret_cast<RefBase::weakref_type*>(
                         tr.target.ptr)->attemptIncStrong(this)) {
-                    error = reinterpret_cast<BHwBinder*>(tr.cookie)->transact(tr.code, buffer,
-                            &reply, tr.flags, reply_callback);
+                    {
+                        ScopedMinScheduling minScheduling(
+                                reinterpret_cast<BHwBinder*>(tr.cookie));
+                        error = reinterpret_cast<BHwBinder*>(tr.cookie)->transact(tr.code,
+                                buffer, &reply, tr.flags, reply_callback);
+                    }
                     reinterpret_cast<BHwBinder*>(tr.cookie)->decStrong(this);
                 } else {
                     error = UNKNOWN_TRANSACTION;
                 }
 
             } else {
+                ScopedMinScheduling minScheduling(the_context_object.get());
                 error = the_context_object->transact(tr.code, buffer, &reply, tr.flags, reply_callback);
             }
 
+            size_t replySize = replyState.size;
+            size_t replyObjects = replyState.objects;
             if ((tr.flags & TF_ONE_WAY) == 0) {
-                if (!reply_sent) {
+                if (!replyState.sent) {
                     // Should have been a reply but there wasn't, so there
                     // must have been an error instead.
                     reply.setError(error);
                     sendReply(reply, 0);
+                    replySize = reply.dataSize();
+                    replyObjects = reply.objectsCount();
                 } else {
                     if (error != NO_ERROR) {
                         ALOGE("transact() returned error after sending reply.");
@@ -1214,25 +2099,41 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
                         // Ok, reply sent and transact didn't return an error.
                     }
                 }
+                recordSizeHint(mReplySizeHints, (uintptr_t)tr.cookie, tr.code,
+                               replySize, replyObjects);
             } else {
                 // One-way transaction, don't care about return value or reply.
             }
 
+            if (statsRecorder != nullptr) {
+                statsRecorder->record(statsSlot, requestSize,
+                                      (uint64_t)(systemTime(SYSTEM_TIME_MONOTONIC) - startNs),
+                                      replySize);
+            }
+            if (recordCapture) {
+                TransactionRecorder::record(TransactionRecorder::INCOMING, tr.cookie, tr.code,
+                                            tr.flags, capturedRequest, startNs,
+                                            systemTime(SYSTEM_TIME_MONOTONIC) - startNs, error);
+            }
+
             //ALOGI("<<<< TRANSACT from pid %d restore pid %d sid %s uid %d\n",
-            //     mCallingPid, origPid, (origSid ? origSid : "<N/A>"), origUid);
+            //     mCalling.pid, origCalling.pid,
+            //     (origCalling.sid ? origCalling.sid : "<N/A>"), origCalling.uid);
 
-            mServingStackPointer = origServingStackPointer;
-            mCallingPid = origPid;
-            mCallingSid = origSid;
-            mCallingUid = origUid;
-            mStrictModePolicy = origStrictModePolicy;
-            mLastTransactionBinderFlags = origTransactionBinderFlags;
+            mCalling = origCalling;
 
             IF_LOG_TRANSACTIONS() {
                 alog << "BC_REPLY thr " << (void*)pthread_self() << " / obj "
                     << tr.target.ptr << ": " << indent << reply << dedent << endl;
             }
 
+            if (useThreadParcels) {
+                // Same as destroying them: the request goes back to the
+                // driver and the reply drops its objects.
+                mDispatchRequest.freeData();
+                mDispatchReply.freeData();
+                mDispatchParcelsInUse = false;
+            }
         }
         break;
 
@@ -1275,7 +2176,7 @@ status_t IPCThreadState::executeCommand(int32_t cmd)
 }
 
 const void* IPCThreadState::getServingStackPointer() const {
-    return mServingStackPointer;
+    return mCalling.servingStackPointer;
 }
 
 void IPCThreadState::threadDestructor(void *st)
@@ -1294,9 +2195,9 @@ void IPCThreadState::threadDestructor(void *st)
 
 
 void IPCThreadState::freeBuffer(Parcel* parcel, const uint8_t* data,
-                                size_t /*dataSize*/,
-                                const binder_size_t* /*objects*/,
-                                size_t /*objectsSize*/, void* /*cookie*/)
+                                size_t dataSize,
+                                const binder_size_t* objects,
+                                size_t objectsSize, void* /*cookie*/)
 {
     //ALOGI("Freeing parcel %p", &parcel);
     IF_LOG_COMMANDS() {
@@ -1305,8 +2206,13 @@ void IPCThreadState::freeBuffer(Parcel* parcel, const uint8_t* data,
     ALOG_ASSERT(data != nullptr, "Called with NULL data");
     if (parcel != nullptr) parcel->closeFileDescriptors();
     IPCThreadState* state = self();
+    const size_t size = receivedBufferSize(data, dataSize, objects, objectsSize);
+    state->mProcess->mmapBufferFreed(size);
+    state->mProcess->mFrees.fetch_add(1, std::memory_order_relaxed);
     state->mOut.writeInt32(BC_FREE_BUFFER);
     state->mOut.writePointer((uintptr_t)data);
+    state->mQueuedFrees++;
+    state->scheduleFreeFlush(size);
 }
 
 } // namespace hardware
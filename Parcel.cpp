@@ -27,6 +27,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/resource.h>
 #include <unistd.h>
 
@@ -41,6 +42,7 @@
 #include <utils/Debug.h>
 #include <utils/Log.h>
 #include <utils/misc.h>
+#include <utils/Mutex.h>
 #include <utils/String8.h>
 #include <utils/String16.h>
 
@@ -48,6 +50,9 @@
 #include <hwbinder/Static.h>
 
 #include <atomic>
+#include <new>
+#include <string>
+#include <unordered_map>
 
 #define LOG_REFS(...)
 //#define LOG_REFS(...) ALOG(LOG_DEBUG, LOG_TAG, __VA_ARGS__)
@@ -78,9 +83,15 @@ namespace hardware {
 
 static std::atomic<size_t> gParcelGlobalAllocCount;
 static std::atomic<size_t> gParcelGlobalAllocSize;
+static std::atomic<size_t> gParcelPoolHitCount;
+static std::atomic<size_t> gParcelPoolMissCount;
 
 static size_t gMaxFds = 0;
 
+// Interned interface tokens, never freed.
+static Mutex gInterfaceTokensLock;
+static std::unordered_map<std::string, const Parcel::InterfaceToken*> gInterfaceTokens;
+
 void acquire_binder_object(const sp<ProcessState>& proc,
     const flat_binder_object& obj, const void* who)
 {
@@ -249,6 +260,187 @@ status_t unflatten_binder(const sp<ProcessState>& proc,
 
 // ---------------------------------------------------------------------------
 
+// Per-thread cache of the buffers backing parcel data and objects arrays.
+//
+// Buffers up to kPoolMaxClassSize bytes are allocated in power-of-two size
+// classes. Freeing one hands it to the calling thread's cache, and the next
+// parcel of a similar size created on that thread picks it up again without
+// going through the allocator. Larger buffers use the heap directly.
+//
+// A buffer's class is derived from the size recorded by its parcel (the data
+// or objects capacity), so a parcel may be freed on any thread.
+
+static const size_t kPoolMinClassShift = 5;                   // 32 bytes
+static const size_t kPoolClassCount = 9;                      // .. 8K
+static const size_t kPoolMaxClassSize = (size_t)1 << (kPoolMinClassShift + kPoolClassCount - 1);
+static const size_t kPoolBuffersPerClass = 2;
+
+struct ParcelBufferPool {
+    void*  buffers[kPoolClassCount][kPoolBuffersPerClass];
+    size_t counts[kPoolClassCount];
+};
+
+static pthread_once_t gParcelPoolKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t gParcelPoolKey;
+
+static void destroyParcelPool(void* st)
+{
+    ParcelBufferPool* pool = static_cast<ParcelBufferPool*>(st);
+    for (size_t c = 0; c < kPoolClassCount; c++) {
+        for (size_t i = 0; i < pool->counts[c]; i++) {
+            free(pool->buffers[c][i]);
+        }
+    }
+    delete pool;
+}
+
+static void makeParcelPoolKey()
+{
+    pthread_key_create(&gParcelPoolKey, destroyParcelPool);
+}
+
+static ParcelBufferPool* getParcelPool(bool create)
+{
+    pthread_once(&gParcelPoolKeyOnce, makeParcelPoolKey);
+    ParcelBufferPool* pool = static_cast<ParcelBufferPool*>(pthread_getspecific(gParcelPoolKey));
+    if (pool == nullptr && create) {
+        pool = new (std::nothrow) ParcelBufferPool();
+        if (pool != nullptr) pthread_setspecific(gParcelPoolKey, pool);
+    }
+    return pool;
+}
+
+// Returns the size class of a buffer of the given size, or kPoolClassCount
+// if it is too large to be pooled.
+static size_t poolClassOf(size_t size)
+{
+    if (size > kPoolMaxClassSize) return kPoolClassCount;
+    size_t c = 0;
+    while (((size_t)1 << (kPoolMinClassShift + c)) < size) c++;
+    return c;
+}
+
+static void* poolAlloc(size_t size)
+{
+    const size_t c = poolClassOf(size);
+    if (c == kPoolClassCount) {
+        gParcelPoolMissCount++;
+        return malloc(size);
+    }
+    ParcelBufferPool* pool = getParcelPool(true);
+    if (pool != nullptr && pool->counts[c] > 0) {
+        gParcelPoolHitCount++;
+        return pool->buffers[c][--pool->counts[c]];
+    }
+    gParcelPoolMissCount++;
+    return malloc((size_t)1 << (kPoolMinClassShift + c));
+}
+
+static void poolFree(void* buffer, size_t size)
+{
+    if (buffer == nullptr) return;
+    const size_t c = poolClassOf(size);
+    if (c != kPoolClassCount) {
+        // Never create a pool here; this may run from another thread-specific
+        // destructor after ours has already gone.
+        ParcelBufferPool* pool = getParcelPool(false);
+        if (pool != nullptr && pool->counts[c] < kPoolBuffersPerClass) {
+            pool->buffers[c][pool->counts[c]++] = buffer;
+            return;
+        }
+    }
+    free(buffer);
+}
+
+// Like realloc(): on failure returns nullptr and leaves the buffer untouched.
+static void* poolRealloc(void* buffer, size_t oldSize, size_t newSize)
+{
+    if (buffer == nullptr) return poolAlloc(newSize);
+
+    const size_t oldClass = poolClassOf(oldSize);
+    const size_t newClass = poolClassOf(newSize);
+    if (oldClass == newClass) {
+        return oldClass == kPoolClassCount ? realloc(buffer, newSize) : buffer;
+    }
+
+    void* newBuffer = poolAlloc(newSize);
+    if (newBuffer == nullptr) return nullptr;
+    memcpy(newBuffer, buffer, oldSize < newSize ? oldSize : newSize);
+    poolFree(buffer, oldSize);
+    return newBuffer;
+}
+
+// ---------------------------------------------------------------------------
+
+// Storage for the data and objects arrays owned by a parcel. Small arrays live
+// in the parcel itself; only larger ones go to the per-thread pool or heap.
+// The inline regions are used whenever they fit and are not already in use.
+
+uint8_t* Parcel::allocDataStorage(size_t capacity)
+{
+    if (capacity <= kInlineDataSize && mData != mInlineData) return mInlineData;
+    return static_cast<uint8_t*>(poolAlloc(capacity));
+}
+
+uint8_t* Parcel::reallocDataStorage(uint8_t* data, size_t oldCapacity, size_t newCapacity)
+{
+    if (data == nullptr) return allocDataStorage(newCapacity);
+
+    const size_t keep = oldCapacity < newCapacity ? oldCapacity : newCapacity;
+    if (data == mInlineData) {
+        if (newCapacity <= kInlineDataSize) return data;
+        uint8_t* heap = static_cast<uint8_t*>(poolAlloc(newCapacity));
+        if (heap != nullptr) memcpy(heap, data, keep);
+        return heap;
+    }
+    if (newCapacity <= kInlineDataSize) {
+        memcpy(mInlineData, data, keep);
+        poolFree(data, oldCapacity);
+        return mInlineData;
+    }
+    return static_cast<uint8_t*>(poolRealloc(data, oldCapacity, newCapacity));
+}
+
+void Parcel::freeDataStorage(uint8_t* data, size_t capacity)
+{
+    if (data != mInlineData) poolFree(data, capacity);
+}
+
+binder_size_t* Parcel::allocObjectsStorage(size_t capacity)
+{
+    if (capacity <= kInlineObjectsCount && mObjects != mInlineObjects) return mInlineObjects;
+    return static_cast<binder_size_t*>(poolAlloc(capacity * sizeof(binder_size_t)));
+}
+
+binder_size_t* Parcel::reallocObjectsStorage(binder_size_t* objects, size_t oldCapacity,
+                                             size_t newCapacity)
+{
+    if (objects == nullptr) return allocObjectsStorage(newCapacity);
+
+    const size_t keep = oldCapacity < newCapacity ? oldCapacity : newCapacity;
+    if (objects == mInlineObjects) {
+        if (newCapacity <= kInlineObjectsCount) return objects;
+        binder_size_t* heap =
+            static_cast<binder_size_t*>(poolAlloc(newCapacity * sizeof(binder_size_t)));
+        if (heap != nullptr) memcpy(heap, objects, keep * sizeof(binder_size_t));
+        return heap;
+    }
+    if (newCapacity <= kInlineObjectsCount) {
+        memcpy(mInlineObjects, objects, keep * sizeof(binder_size_t));
+        poolFree(objects, oldCapacity * sizeof(binder_size_t));
+        return mInlineObjects;
+    }
+    return static_cast<binder_size_t*>(poolRealloc(objects, oldCapacity * sizeof(binder_size_t),
+                                                   newCapacity * sizeof(binder_size_t)));
+}
+
+void Parcel::freeObjectsStorage(binder_size_t* objects, size_t capacity)
+{
+    if (objects != mInlineObjects) poolFree(objects, capacity * sizeof(binder_size_t));
+}
+
+// ---------------------------------------------------------------------------
+
 Parcel::Parcel()
 {
     LOG_ALLOC("Parcel %p: constructing", this);
@@ -269,6 +461,14 @@ size_t Parcel::getGlobalAllocCount() {
     return gParcelGlobalAllocCount.load();
 }
 
+size_t Parcel::getGlobalPoolHitCount() {
+    return gParcelPoolHitCount.load();
+}
+
+size_t Parcel::getGlobalPoolMissCount() {
+    return gParcelPoolMissCount.load();
+}
+
 const uint8_t* Parcel::data() const
 {
     return mData;
@@ -339,6 +539,24 @@ status_t Parcel::setDataCapacity(size_t size)
     return NO_ERROR;
 }
 
+status_t Parcel::reserve(size_t dataBytes, size_t objectsCount)
+{
+    // The data and objects of a received parcel belong to the driver.
+    if (mOwner) return INVALID_OPERATION;
+
+    status_t err = setDataCapacity(dataBytes);
+    if (err != NO_ERROR) return err;
+
+    if (objectsCount > mObjectsCapacity) {
+        if (objectsCount > SIZE_MAX / sizeof(binder_size_t)) return NO_MEMORY; // overflow
+        binder_size_t* objects = reallocObjectsStorage(mObjects, mObjectsCapacity, objectsCount);
+        if (objects == nullptr) return NO_MEMORY;
+        mObjects = objects;
+        mObjectsCapacity = objectsCount;
+    }
+    return NO_ERROR;
+}
+
 status_t Parcel::setData(const uint8_t* buffer, size_t len)
 {
     if (len > INT32_MAX) {
@@ -375,6 +593,55 @@ bool Parcel::enforceInterface(const char* interface) const
     }
 }
 
+// static
+const Parcel::InterfaceToken* Parcel::internInterfaceToken(const char* interface)
+{
+    if (interface == nullptr) return nullptr;
+
+    AutoMutex _l(gInterfaceTokensLock);
+    auto it = gInterfaceTokens.find(interface);
+    if (it != gInterfaceTokens.end()) return it->second;
+
+    const size_t length = strlen(interface);
+    const size_t padded = pad_size(length + 1);
+    char* name = static_cast<char*>(calloc(padded, 1));
+    InterfaceToken* token = new (std::nothrow) InterfaceToken;
+    if (name == nullptr || token == nullptr) {
+        free(name);
+        delete token;
+        return nullptr;
+    }
+    memcpy(name, interface, length);
+    token->name = name;
+    token->length = length;
+    token->padded = padded;
+    gInterfaceTokens.emplace(std::string(interface, length), token);
+    return token;
+}
+
+status_t Parcel::writeInterfaceToken(const InterfaceToken* token)
+{
+    if (token == nullptr) return BAD_VALUE;
+    // The token is padded already, so the bytes go in as they are.
+    void* dest = writeInplace(token->padded);
+    if (dest == nullptr) return NO_MEMORY;
+    memcpy(dest, token->name, token->padded);
+    return NO_ERROR;
+}
+
+bool Parcel::enforceInterface(const InterfaceToken* token) const
+{
+    if (token == nullptr) return false;
+    // A match is the name followed by its NUL; what follows up to the
+    // padded size is skipped just as readCString() would.
+    if (mDataPos < mDataSize && mDataSize - mDataPos >= token->padded &&
+        memcmp(mData + mDataPos, token->name, token->length + 1) == 0) {
+        mDataPos += token->padded;
+        return true;
+    }
+    return enforceInterface(token->name);
+}
+
 const binder_size_t* Parcel::objects() const
 {
     return mObjects;
@@ -597,19 +864,16 @@ status_t Parcel::writeString16(const String16& str)
 status_t Parcel::writeString16(const char16_t* str, size_t len)
 {
     if (str == nullptr) return writeInt32(-1);
-
-    status_t err = writeInt32(len);
-    if (err == NO_ERROR) {
-        len *= sizeof(char16_t);
-        uint8_t* data = (uint8_t*)writeInplace(len+sizeof(char16_t));
-        if (data) {
-            memcpy(data, str, len);
-            *reinterpret_cast<char16_t*>(data+len) = 0;
-            return NO_ERROR;
-        }
-        err = mError;
-    }
-    return err;
+    if (len >= (INT32_MAX - sizeof(int32_t)) / sizeof(char16_t)) return BAD_VALUE;
+
+    // The length, the characters and the terminator go in with one write.
+    const size_t bytes = len * sizeof(char16_t);
+    uint8_t* data = (uint8_t*)writeInplace(sizeof(int32_t) + bytes + sizeof(char16_t));
+    if (data == nullptr) return NO_MEMORY;
+    *reinterpret_cast<int32_t*>(data) = len;
+    memcpy(data + sizeof(int32_t), str, bytes);
+    *reinterpret_cast<char16_t*>(data + sizeof(int32_t) + bytes) = 0;
+    return NO_ERROR;
 }
 status_t Parcel::writeStrongBinder(const sp<IBinder>& val)
 {
@@ -672,19 +936,29 @@ restart_write:
         if (err != NO_ERROR) return err;
     }
     if (!enoughObjects) {
-        if (mObjectsSize > SIZE_MAX - 2) return NO_MEMORY; // overflow
-        if (mObjectsSize + 2 > SIZE_MAX / 3) return NO_MEMORY; // overflow
-        size_t newSize = ((mObjectsSize+2)*3)/2;
-        if (newSize > SIZE_MAX / sizeof(binder_size_t)) return NO_MEMORY; // overflow
-        binder_size_t* objects = (binder_size_t*)realloc(mObjects, newSize*sizeof(binder_size_t));
-        if (objects == nullptr) return NO_MEMORY;
-        mObjects = objects;
-        mObjectsCapacity = newSize;
+        const status_t err = growObjects(1);
+        if (err != NO_ERROR) return err;
     }
 
     goto restart_write;
 }
 
+status_t Parcel::growObjects(size_t count)
+{
+    if (mObjectsSize > SIZE_MAX - 2) return NO_MEMORY; // overflow
+    if (mObjectsSize + 2 > SIZE_MAX / 3) return NO_MEMORY; // overflow
+    if (count > SIZE_MAX - mObjectsSize) return NO_MEMORY; // overflow
+    size_t newSize = ((mObjectsSize+2)*3)/2;
+    if (newSize < mObjectsSize + count) newSize = mObjectsSize + count;
+    if (newSize > SIZE_MAX / sizeof(binder_size_t)) return NO_MEMORY; // overflow
+    if (newSize < kInlineObjectsCount) newSize = kInlineObjectsCount;
+    binder_size_t* objects = reallocObjectsStorage(mObjects, mObjectsCapacity, newSize);
+    if (objects == nullptr) return NO_MEMORY;
+    mObjects = objects;
+    mObjectsCapacity = newSize;
+    return NO_ERROR;
+}
+
 template status_t Parcel::writeObject<flat_binder_object>(const flat_binder_object& val);
 template status_t Parcel::writeObject<binder_fd_object>(const binder_fd_object& val);
 template status_t Parcel::writeObject<binder_buffer_object>(const binder_buffer_object& val);
@@ -760,10 +1034,64 @@ status_t Parcel::writeBuffer(const void *buffer, size_t length, size_t *handle)
     return writeObject(obj);
 }
 
+status_t Parcel::writeBuffers(const struct iovec* segments, size_t count,
+                              const std::shared_ptr<const void>& guard,
+                              size_t* firstHandle)
+{
+    LOG_BUFFER("writeBuffers(%p, %zu) -> %zu", segments, count, mObjectsSize);
+    if (count > INT32_MAX / sizeof(binder_buffer_object)) return BAD_VALUE;
+
+    // Size everything up front so that the loop below never reallocates.
+    const size_t dataNeeded = count * sizeof(binder_buffer_object);
+    if (mDataPos + dataNeeded > mDataCapacity) {
+        const status_t err = growData(dataNeeded);
+        if (err != NO_ERROR) return err;
+    }
+    if (count > mObjectsCapacity - mObjectsSize) {
+        const status_t err = growObjects(count);
+        if (err != NO_ERROR) return err;
+    }
+    if (guard != nullptr) {
+        mBufferGuards.push_back(guard);
+    }
+
+    if (firstHandle != nullptr) {
+        // We use an index into mObjects as a handle
+        *firstHandle = mObjectsSize;
+    }
+    for (size_t i = 0; i < count; i++) {
+        binder_buffer_object* obj =
+                reinterpret_cast<binder_buffer_object*>(mData + mDataPos);
+        *obj = binder_buffer_object {
+            .hdr = { .type = BINDER_TYPE_PTR },
+            .flags = 0,
+            .buffer = reinterpret_cast<binder_uintptr_t>(segments[i].iov_base),
+            .length = segments[i].iov_len,
+        };
+        if (segments[i].iov_base != nullptr) {
+            mObjects[mObjectsSize++] = mDataPos;
+        }
+        finishWrite(sizeof(binder_buffer_object));
+    }
+    return NO_ERROR;
+}
+
+// Number of objects above which readObject() looks up offsets it can't find
+// at its hint in mObjectIndex instead of scanning mObjects.
+static const size_t kObjectIndexThreshold = 8;
+
+// Number of buffers above which findBuffer() and quickFindBuffer() switch
+// from scanning mBufCache to the indexes built next to it.
+static const size_t kBufIndexThreshold = 16;
+
 void Parcel::clearCache() const {
     LOG_BUFFER("clearing cache.");
     mBufCachePos = 0;
     mBufCache.clear();
+    mBufStartIndex.clear();
+    mBufStartHash.clear();
+    mBufIndexed = false;
+    mBufOverlap = false;
 }
 
 void Parcel::updateCache() const {
@@ -781,11 +1109,45 @@ void Parcel::updateCache() const {
         ifo.buffer = obj->buffer;
         ifo.bufend = obj->buffer + obj->length;
         mBufCache.push_back(ifo);
+        if (mBufIndexed) indexBuffer(mBufCache.size() - 1);
     }
     mBufCachePos = mObjectsSize;
+
+    if (!mBufIndexed && mBufCache.size() > kBufIndexThreshold) {
+        LOG_BUFFER("indexing %zu buffers", mBufCache.size());
+        mBufIndexed = true;
+        for (size_t i = 0; i < mBufCache.size(); i++) {
+            indexBuffer(i);
+        }
+    }
+}
+
+void Parcel::indexBuffer(size_t cachePos) const {
+    const BufferInfo& ifo = mBufCache[cachePos];
+    // Later buffers win, as with the reverse scan.
+    mBufStartHash[ifo.buffer] = cachePos;
+
+    // Empty buffers can't contain anything.
+    if (ifo.bufend == ifo.buffer || mBufOverlap)
+        return;
+
+    // While buffers don't overlap, the only candidate for containing an
+    // address is the buffer starting closest below it. Once two overlap,
+    // findBuffer() goes back to scanning.
+    auto next = mBufStartIndex.lower_bound(ifo.buffer);
+    if (next != mBufStartIndex.end() && next->first < ifo.bufend) {
+        mBufOverlap = true;
+        return;
+    }
+    if (next != mBufStartIndex.begin() && mBufCache[std::prev(next)->second].bufend > ifo.buffer) {
+        mBufOverlap = true;
+        return;
+    }
+    mBufStartIndex.emplace_hint(next, ifo.buffer, cachePos);
 }
 
-/* O(n) (n=#buffers) to find a buffer that contains the given addr */
+/* O(log n) (n=#buffers) to find a buffer that contains the given addr, O(n)
+ * for small parcels or when buffers overlap */
 status_t Parcel::findBuffer(const void *ptr, size_t length, bool *found,
                         size_t *handle, size_t *offset) const {
     if(found == nullptr)
@@ -796,6 +1158,25 @@ status_t Parcel::findBuffer(const void *ptr, size_t length, bool *found,
     // so that ptr + length doesn't fit into the buffer.
     bool suspectRejectBadPointer = false;
     LOG_BUFFER("findBuffer examining %zu objects.", mObjectsSize);
+    if (mBufIndexed && !mBufOverlap) {
+        auto entry = mBufStartIndex.upper_bound(ptrVal);
+        if (entry != mBufStartIndex.begin()) {
+            const BufferInfo& ifo = mBufCache[std::prev(entry)->second];
+            if (ptrVal < ifo.bufend) {
+                if (ptrVal + length <= ifo.bufend) {
+                    *found = true;
+                    if(handle != nullptr) *handle = ifo.index;
+                    if(offset != nullptr) *offset = ptrVal - ifo.buffer;
+                    LOG_BUFFER("    findBuffer has a match at %zu!", ifo.index);
+                    return OK;
+                }
+                suspectRejectBadPointer = true;
+            }
+        }
+        LOG_BUFFER("findBuffer did not find for ptr = %p.", ptr);
+        *found = false;
+        return suspectRejectBadPointer ? BAD_VALUE : OK;
+    }
     for(auto entry = mBufCache.rbegin(); entry != mBufCache.rend(); ++entry ) {
         if(entry->buffer <= ptrVal && ptrVal < entry->bufend) {
             // might have found it.
@@ -822,6 +1203,15 @@ status_t Parcel::quickFindBuffer(const void *ptr, size_t *handle) const {
     updateCache();
     binder_uintptr_t ptrVal = reinterpret_cast<binder_uintptr_t>(ptr);
     LOG_BUFFER("quickFindBuffer examining %zu objects.", mObjectsSize);
+    if (mBufIndexed) {
+        auto entry = mBufStartHash.find(ptrVal);
+        if (entry != mBufStartHash.end()) {
+            if(handle != nullptr) *handle = mBufCache[entry->second].index;
+            return OK;
+        }
+        LOG_BUFFER("quickFindBuffer did not find for ptr = %p.", ptr);
+        return NO_INIT;
+    }
     for(auto entry = mBufCache.rbegin(); entry != mBufCache.rend(); ++entry ) {
         if(entry->buffer == ptrVal) {
             if(handle != nullptr) *handle = entry->index;
@@ -837,38 +1227,55 @@ status_t Parcel::writeNativeHandleNoDup(const native_handle_t *handle,
                                         size_t parent_buffer_handle,
                                         size_t parent_offset)
 {
-    size_t buffer_handle;
-    status_t status = OK;
-
     if (handle == nullptr) {
-        status = writeUint64(0);
-        return status;
+        return writeUint64(0);
     }
 
-    size_t native_handle_size = sizeof(native_handle_t)
-                + handle->numFds * sizeof(int) + handle->numInts * sizeof(int);
-    writeUint64(native_handle_size);
-
-    if (embedded) {
-        status = writeEmbeddedBuffer((void*) handle,
-                native_handle_size, &buffer_handle,
-                parent_buffer_handle, parent_offset);
-    } else {
-        status = writeBuffer((void*) handle, native_handle_size, &buffer_handle);
+    if (embedded && !validateBufferParent(parent_buffer_handle, parent_offset)) {
+        return BAD_VALUE;
     }
 
-    if (status != OK) {
-        return status;
+    // The size, the buffer holding the handle and the fd array inside it are
+    // always written together, so make room for all three at once and lay
+    // them down without going through writeObject().
+    const size_t bufferPos = mDataPos + sizeof(uint64_t);
+    const size_t fdArrayPos = bufferPos + sizeof(binder_buffer_object);
+    const size_t len = fdArrayPos + sizeof(binder_fd_array_object) - mDataPos;
+    if (mDataPos + len > mDataCapacity) {
+        const status_t err = growData(len);
+        if (err != NO_ERROR) return err;
     }
+    if (mObjectsCapacity - mObjectsSize < 2) {
+        const status_t err = growObjects(2);
+        if (err != NO_ERROR) return err;
+    }
+
+    size_t native_handle_size = sizeof(native_handle_t)
+                + handle->numFds * sizeof(int) + handle->numInts * sizeof(int);
+    *reinterpret_cast<uint64_t*>(mData + mDataPos) = native_handle_size;
 
-    struct binder_fd_array_object fd_array {
+    const size_t buffer_handle = mObjectsSize;
+    LOG_BUFFER("writeNativeHandleNoDup(%p, %zu, embedded = %d) -> %zu",
+        handle, native_handle_size, embedded, buffer_handle);
+    *reinterpret_cast<binder_buffer_object*>(mData + bufferPos) = {
+        .hdr = { .type = BINDER_TYPE_PTR },
+        .flags = embedded ? BINDER_BUFFER_FLAG_HAS_PARENT : 0u,
+        .buffer = reinterpret_cast<binder_uintptr_t>(handle),
+        .length = native_handle_size,
+        .parent = embedded ? parent_buffer_handle : 0,
+        .parent_offset = embedded ? parent_offset : 0,
+    };
+    mObjects[mObjectsSize++] = bufferPos;
+
+    *reinterpret_cast<binder_fd_array_object*>(mData + fdArrayPos) = {
         .hdr = { .type = BINDER_TYPE_FDA },
         .num_fds = static_cast<binder_size_t>(handle->numFds),
         .parent = buffer_handle,
         .parent_offset = offsetof(native_handle_t, data),
     };
+    mObjects[mObjectsSize++] = fdArrayPos;
 
-    return writeObject(fd_array);
+    return finishWrite(len);
 }
 
 status_t Parcel::writeNativeHandleNoDup(const native_handle_t *handle)
@@ -964,6 +1371,39 @@ restart_write:
     return err;
 }
 
+#define PARCEL_ARRAY_METHODS(type, name)                                        \
+    status_t Parcel::write##name##Array(const type* values, size_t count)       \
+    {                                                                           \
+        return writeArray(values, count);                                       \
+    }                                                                           \
+    status_t Parcel::read##name##Array(std::vector<type>* values) const         \
+    {                                                                           \
+        return readArray(values);                                               \
+    }
+
+// Only for elements that 4-byte aligned parcel data can hold in place.
+#define PARCEL_ARRAY_INPLACE_METHOD(type, name)                                 \
+    const type* Parcel::read##name##ArrayInplace(size_t* outCount) const        \
+    {                                                                           \
+        const type* values;                                                     \
+        readArrayInplace(&values, outCount);                                    \
+        return values;                                                          \
+    }
+
+PARCEL_ARRAY_METHODS(int32_t, Int32)
+PARCEL_ARRAY_METHODS(uint32_t, Uint32)
+PARCEL_ARRAY_METHODS(int64_t, Int64)
+PARCEL_ARRAY_METHODS(uint64_t, Uint64)
+PARCEL_ARRAY_METHODS(float, Float)
+PARCEL_ARRAY_METHODS(double, Double)
+
+PARCEL_ARRAY_INPLACE_METHOD(int32_t, Int32)
+PARCEL_ARRAY_INPLACE_METHOD(uint32_t, Uint32)
+PARCEL_ARRAY_INPLACE_METHOD(float, Float)
+
+#undef PARCEL_ARRAY_INPLACE_METHOD
+#undef PARCEL_ARRAY_METHODS
+
 status_t Parcel::readInt8(int8_t *pArg) const
 {
     return read(pArg, sizeof(*pArg));
@@ -1257,7 +1697,18 @@ const T* Parcel::readObject(size_t *objects_offset) const
         const size_t N = mObjectsSize;
         size_t opos = mNextObjectHint;
 
-        if (N > 0) {
+        if (N > kObjectIndexThreshold && mObjectsValidated &&
+            !(opos < N && OBJS[opos] == DPOS)) {
+            // The hint missed; rather than scanning, look it up directly.
+            const ssize_t index = findIndexedObject(DPOS);
+            if (index >= 0) {
+                mNextObjectHint = index + 1;
+                if (objects_offset != nullptr) {
+                    *objects_offset = index;
+                }
+                return obj;
+            }
+        } else if (N > 0) {
             ALOGV("Parcel %p looking for obj at %zu, hint=%zu",
                  this, DPOS, opos);
 
@@ -1312,6 +1763,46 @@ template const binder_buffer_object* Parcel::readObject<binder_buffer_object>(si
 
 template const binder_fd_array_object* Parcel::readObject<binder_fd_array_object>(size_t *objects_offset) const;
 
+void Parcel::buildObjectIndex() const
+{
+    size_t capacity = 16;
+    while (capacity < mObjectsSize * 2) {
+        capacity <<= 1;
+    }
+    mObjectIndex.assign(capacity, 0);
+    for (size_t i = 0; i < mObjectsSize; i++) {
+        size_t slot = (size_t)((mObjects[i] >> 2) * 0x9E3779B1u) & (capacity - 1);
+        while (mObjectIndex[slot] != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        mObjectIndex[slot] = (uint32_t)(i + 1);
+    }
+}
+
+ssize_t Parcel::findIndexedObject(size_t dataPos) const
+{
+    if (mObjectIndex.empty()) {
+        buildObjectIndex();
+    }
+    const size_t mask = mObjectIndex.size() - 1;
+    size_t slot = (size_t)((dataPos >> 2) * 0x9E3779B1u) & mask;
+    // Offsets are unique, and the table is at most half full.
+    while (mObjectIndex[slot] != 0) {
+        const size_t index = mObjectIndex[slot] - 1;
+        if (mObjects[index] == dataPos) {
+            return index;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return -1;
+}
+
+void Parcel::clearObjectIndex()
+{
+    mObjectIndex.clear();
+    mObjectsValidated = false;
+}
+
 bool Parcel::verifyBufferObject(const binder_buffer_object *buffer_obj,
                                 size_t size, uint32_t flags, size_t parent,
                                 size_t parentOffset) const {
@@ -1507,7 +1998,18 @@ status_t Parcel::readNullableNativeHandleNoDup(const native_handle_t **handle,
         return BAD_VALUE;
     }
 
-    const binder_fd_array_object* fd_array_obj = readObject<binder_fd_array_object>();
+    // Writers put the fd array right after the buffer, both in the data and
+    // in the object list; take it from there rather than searching for it.
+    const binder_fd_array_object* fd_array_obj;
+    const size_t fdArrayPos = mDataPos;
+    if (fdaParent + 1 < mObjectsSize && mObjects[fdaParent + 1] == fdArrayPos &&
+            fdArrayPos + sizeof(binder_fd_array_object) <= mDataSize) {
+        fd_array_obj = reinterpret_cast<const binder_fd_array_object*>(mData + fdArrayPos);
+        mDataPos = fdArrayPos + sizeof(binder_fd_array_object);
+        mNextObjectHint = fdaParent + 2;
+    } else {
+        fd_array_obj = readObject<binder_fd_array_object>();
+    }
 
     if (fd_array_obj == nullptr || fd_array_obj->hdr.type != BINDER_TYPE_FDA) {
         ALOGE("Can't find file-descriptor array object.");
@@ -1616,6 +2118,115 @@ size_t Parcel::ipcBufferSize() const
     return totalBuffersSize;
 }
 
+status_t Parcel::copyFrom(const Parcel& other)
+{
+    if (this == &other) return NO_ERROR;
+    if (other.errorCheck() != NO_ERROR) return other.errorCheck();
+
+    const size_t dataSize = other.ipcDataSize();
+    // The buffers are stored after the flat data, each one 8-byte aligned
+    const size_t buffersStart = (dataSize + (BUFFER_ALIGNMENT_BYTES - 1))
+            & ~(BUFFER_ALIGNMENT_BYTES - 1);
+    const size_t buffersSize = other.ipcBufferSize();
+    if (buffersStart < dataSize || buffersSize > SIZE_MAX - buffersStart) {
+        return NO_MEMORY;
+    }
+
+    status_t err = restartWrite(buffersStart + buffersSize);
+    if (err != NO_ERROR) return err;
+    if (dataSize == 0) return NO_ERROR;
+
+    memcpy(mData, other.mData, dataSize);
+    mDataSize = dataSize;
+
+    if (other.mObjectsSize > 0) {
+        binder_size_t* objects =
+            allocObjectsStorage(other.mObjectsSize);
+        if (!objects) {
+            freeData();
+            mError = NO_MEMORY;
+            return NO_MEMORY;
+        }
+        memcpy(objects, other.mObjects, other.mObjectsSize * sizeof(binder_size_t));
+        mObjects = objects;
+        mObjectsSize = mObjectsCapacity = other.mObjectsSize;
+
+        uint8_t* buffers = mData + buffersStart;
+        size_t i = 0;
+        for (; i < mObjectsSize; i++) {
+            binder_object_header* hdr = reinterpret_cast<binder_object_header*>(mData + mObjects[i]);
+            if (hdr->type == BINDER_TYPE_PTR) {
+                binder_buffer_object* buffer = reinterpret_cast<binder_buffer_object*>(hdr);
+                memcpy(buffers, reinterpret_cast<const void*>(buffer->buffer), buffer->length);
+                buffer->buffer = reinterpret_cast<binder_uintptr_t>(buffers);
+                buffers += (buffer->length + (BUFFER_ALIGNMENT_BYTES - 1))
+                        & ~(BUFFER_ALIGNMENT_BYTES - 1);
+            } else if (hdr->type == BINDER_TYPE_FD) {
+                // The copy owns a duplicate, so it stays valid however long
+                // the original descriptor lives.
+                flat_binder_object* fdObj = reinterpret_cast<flat_binder_object*>(hdr);
+                fdObj->cookie = 0;
+                const int fd = fcntl(fdObj->handle, F_DUPFD_CLOEXEC, 0);
+                if (fd < 0) {
+                    err = -errno;
+                    ALOGE("copyFrom(): failed to dup fd %u: %s", fdObj->handle, strerror(errno));
+                    break;
+                }
+                fdObj->handle = fd;
+                fdObj->cookie = 1;
+            } else if (hdr->type == BINDER_TYPE_FDA) {
+                // The descriptors live in a parent buffer copied above; they
+                // are duplicated in place and closed with the copy.
+                const binder_fd_array_object* fda =
+                        reinterpret_cast<const binder_fd_array_object*>(hdr);
+                const binder_buffer_object* parent = nullptr;
+                if (fda->parent < i) {
+                    parent = reinterpret_cast<const binder_buffer_object*>(
+                            mData + mObjects[fda->parent]);
+                }
+                if (parent == nullptr || parent->hdr.type != BINDER_TYPE_PTR ||
+                    fda->num_fds > parent->length / sizeof(int) ||
+                    fda->parent_offset > parent->length - fda->num_fds * sizeof(int)) {
+                    err = BAD_VALUE;
+                    break;
+                }
+                int* fds = reinterpret_cast<int*>(parent->buffer + fda->parent_offset);
+                for (size_t j = 0; j < fda->num_fds; j++) {
+                    const int fd = fcntl(fds[j], F_DUPFD_CLOEXEC, 0);
+                    if (fd < 0) {
+                        err = -errno;
+                        ALOGE("copyFrom(): failed to dup fd %d: %s", fds[j], strerror(errno));
+                        break;
+                    }
+                    fds[j] = fd;
+                    mOwnedFds.push_back(fd);
+                }
+                if (err != NO_ERROR) break;
+            }
+        }
+        if (err != NO_ERROR) {
+            // Nothing has been acquired yet; only the duplicates need closing.
+            for (size_t j = 0; j < i; j++) {
+                const flat_binder_object* flat =
+                        reinterpret_cast<const flat_binder_object*>(mData + mObjects[j]);
+                if (flat->hdr.type == BINDER_TYPE_FD && flat->cookie != 0) {
+                    close(flat->handle);
+                }
+            }
+            mObjectsSize = 0;
+            freeData();
+            mError = err;
+            return err;
+        }
+        acquireObjects();
+    }
+
+    mHasFds = other.mHasFds;
+    mFdsKnown = other.mFdsKnown;
+    mAllowFds = other.mAllowFds;
+    return NO_ERROR;
+}
+
 void Parcel::ipcSetDataReference(const uint8_t* data, size_t dataSize,
     const binder_size_t* objects, size_t objectsCount, release_func relFunc, void* relCookie)
 {
@@ -1631,6 +2242,7 @@ void Parcel::ipcSetDataReference(const uint8_t* data, size_t dataSize,
     mObjectsSize = mObjectsCapacity = objectsCount;
     mNextObjectHint = 0;
     clearCache();
+    clearObjectIndex();
     mOwner = relFunc;
     mOwnerCookie = relCookie;
     for (size_t i = 0; i < mObjectsSize; i++) {
@@ -1643,6 +2255,9 @@ void Parcel::ipcSetDataReference(const uint8_t* data, size_t dataSize,
         }
         minOffset = offset + sizeof(flat_binder_object);
     }
+    // The offsets can't change while the driver owns the buffer, so it is
+    // safe to index them; any write first takes ownership in continueWrite().
+    mObjectsValidated = true;
     scanForFds();
 }
 
@@ -1683,6 +2298,11 @@ void Parcel::print(TextOutput& to, uint32_t /*flags*/) const
 
 void Parcel::releaseObjects()
 {
+    for (int fd : mOwnedFds) {
+        close(fd);
+    }
+    mOwnedFds.clear();
+
     const sp<ProcessState> proc(ProcessState::self());
     size_t i = mObjectsSize;
     uint8_t* const data = mData;
@@ -1715,8 +2335,19 @@ void Parcel::freeData()
     initState();
 }
 
+status_t Parcel::releaseKernelBufferNow() const
+{
+    if (mOwner == nullptr) return INVALID_OPERATION;
+    // The receiver owns the buffer, even through a const reference.
+    const_cast<Parcel*>(this)->freeData();
+    ProcessState::self()->mEarlyReleases.fetch_add(1, std::memory_order_relaxed);
+    IPCThreadState::self()->flushFreedBuffers();
+    return NO_ERROR;
+}
+
 void Parcel::freeDataNoInit()
 {
+    mBufferGuards.clear();
     if (mOwner) {
         LOG_ALLOC("Parcel %p: freeing other owner data", this);
         //ALOGI("Freeing data ref of %p (pid=%d)", this, getpid());
@@ -1728,9 +2359,9 @@ void Parcel::freeDataNoInit()
             LOG_ALLOC("Parcel %p: freeing with %zu capacity", this, mDataCapacity);
             gParcelGlobalAllocSize -= mDataCapacity;
             gParcelGlobalAllocCount--;
-            free(mData);
+            freeDataStorage(mData, mDataCapacity);
         }
-        if (mObjects) free(mObjects);
+        freeObjectsStorage(mObjects, mObjectsCapacity);
     }
 }
 
@@ -1760,7 +2391,7 @@ status_t Parcel::restartWrite(size_t desired)
         return continueWrite(desired);
     }
 
-    uint8_t* data = (uint8_t*)realloc(mData, desired);
+    uint8_t* data = reallocDataStorage(mData, mDataCapacity, desired);
     if (!data && desired > mDataCapacity) {
         mError = NO_MEMORY;
         return NO_MEMORY;
@@ -1784,10 +2415,11 @@ status_t Parcel::restartWrite(size_t desired)
     }
 
     mDataSize = mDataPos = 0;
+    mBufferGuards.clear();
     ALOGV("restartWrite Setting data size of %p to %zu", this, mDataSize);
     ALOGV("restartWrite Setting data pos of %p to %zu", this, mDataPos);
 
-    free(mObjects);
+    freeObjectsStorage(mObjects, mObjectsCapacity);
     mObjects = nullptr;
     mObjectsSize = mObjectsCapacity = 0;
     mNextObjectHint = 0;
@@ -1831,7 +2463,7 @@ status_t Parcel::continueWrite(size_t desired)
 
         // If there is a different owner, we need to take
         // posession.
-        uint8_t* data = (uint8_t*)malloc(desired);
+        uint8_t* data = allocDataStorage(desired);
         if (!data) {
             mError = NO_MEMORY;
             return NO_MEMORY;
@@ -1839,9 +2471,9 @@ status_t Parcel::continueWrite(size_t desired)
         binder_size_t* objects = nullptr;
 
         if (objectsSize) {
-            objects = (binder_size_t*)calloc(objectsSize, sizeof(binder_size_t));
+            objects = allocObjectsStorage(objectsSize);
             if (!objects) {
-                free(data);
+                freeDataStorage(data, desired);
 
                 mError = NO_MEMORY;
                 return NO_MEMORY;
@@ -1864,6 +2496,7 @@ status_t Parcel::continueWrite(size_t desired)
         //ALOGI("Freeing data ref of %p (pid=%d)", this, getpid());
         mOwner(this, mData, mDataSize, mObjects, mObjectsSize, mOwnerCookie);
         mOwner = nullptr;
+        clearObjectIndex();
 
         LOG_ALLOC("Parcel %p: taking ownership of %zu capacity", this, desired);
         gParcelGlobalAllocSize += desired;
@@ -1893,13 +2526,15 @@ status_t Parcel::continueWrite(size_t desired)
             }
 
             if (objectsSize == 0) {
-                free(mObjects);
+                freeObjectsStorage(mObjects, mObjectsCapacity);
                 mObjects = nullptr;
+                mObjectsCapacity = 0;
             } else {
                 binder_size_t* objects =
-                    (binder_size_t*)realloc(mObjects, objectsSize*sizeof(binder_size_t));
+                    reallocObjectsStorage(mObjects, mObjectsCapacity, objectsSize);
                 if (objects) {
                     mObjects = objects;
+                    mObjectsCapacity = objectsSize;
                 }
             }
             mObjectsSize = objectsSize;
@@ -1910,7 +2545,7 @@ status_t Parcel::continueWrite(size_t desired)
 
         // We own the data, so we can just do a realloc().
         if (desired > mDataCapacity) {
-            uint8_t* data = (uint8_t*)realloc(mData, desired);
+            uint8_t* data = reallocDataStorage(mData, mDataCapacity, desired);
             if (data) {
                 LOG_ALLOC("Parcel %p: continue from %zu to %zu capacity", this, mDataCapacity,
                         desired);
@@ -1935,7 +2570,7 @@ status_t Parcel::continueWrite(size_t desired)
 
     } else {
         // This is the first data.  Easy!
-        uint8_t* data = (uint8_t*)malloc(desired);
+        uint8_t* data = allocDataStorage(desired);
         if (!data) {
             mError = NO_MEMORY;
             return NO_MEMORY;
@@ -1979,6 +2614,7 @@ void Parcel::initState()
     mAllowFds = true;
     mOwner = nullptr;
     clearCache();
+    clearObjectIndex();
 
     // racing multiple init leads only to multiple identical write
     if (gMaxFds == 0) {
@@ -23,22 +23,34 @@
 #include <hwbinder/IPCThreadState.h>
 #include <utils/Log.h>
 #include <utils/String8.h>
+#include <utils/SystemClock.h>
+#include <utils/Timers.h>
 #include <utils/threads.h>
 
+#include <android-base/properties.h>
+
 #include "binder_kernel.h"
 #include <hwbinder/Static.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/sched.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <new>
+
 #define DEFAULT_BINDER_VM_SIZE ((1 * 1024 * 1024) - sysconf(_SC_PAGE_SIZE) * 2)
+// The driver refuses to map more than this.
+#define MAX_BINDER_VM_SIZE (4 * 1024 * 1024)
 #define DEFAULT_MAX_BINDER_THREADS 0
 
 // -------------------------------------------------------------------------
@@ -55,8 +67,15 @@ public:
     }
 
 protected:
+    virtual status_t readyToRun()
+    {
+        ProcessState::self()->configurePooledThread();
+        return NO_ERROR;
+    }
+
     virtual bool threadLoop()
     {
+        ProcessState::self()->pooledThreadStarted();
         IPCThreadState::self()->joinThreadPool(mIsMain);
         return false;
     }
@@ -66,7 +85,7 @@ protected:
 
 sp<ProcessState> ProcessState::self()
 {
-    return init(DEFAULT_BINDER_VM_SIZE, false /*requireMmapSize*/);
+    return init(defaultMmapSize(), false /*requireMmapSize*/);
 }
 
 sp<ProcessState> ProcessState::selfOrNull() {
@@ -77,6 +96,21 @@ sp<ProcessState> ProcessState::initWithMmapSize(size_t mmapSize) {
     return init(mmapSize, true /*requireMmapSize*/);
 }
 
+size_t ProcessState::defaultMmapSize() {
+    static const size_t sSize = []() -> size_t {
+        const size_t page = sysconf(_SC_PAGE_SIZE);
+        const size_t fallback = DEFAULT_BINDER_VM_SIZE;
+        size_t size = base::GetUintProperty<size_t>("ro.hwbinder.mmap_size", fallback,
+                                                    SIZE_MAX);
+        size = base::GetUintProperty<size_t>(
+                std::string("ro.hwbinder.mmap_size.") + program_invocation_short_name, size, SIZE_MAX);
+        if (size < page) size = page;
+        if (size > MAX_BINDER_VM_SIZE) size = MAX_BINDER_VM_SIZE;
+        return size & ~(page - 1);
+    }();
+    return sSize;
+}
+
 sp<ProcessState> ProcessState::init(size_t mmapSize, bool requireMmapSize) {
     [[clang::no_destroy]] static sp<ProcessState> gProcess;
     [[clang::no_destroy]] static std::mutex gProcessMutex;
@@ -157,7 +191,15 @@ void ProcessState::startThreadPool()
     AutoMutex _l(mLock);
     if (!mThreadPoolStarted) {
         mThreadPoolStarted = true;
-        if (mSpawnThreadOnStart) {
+        if (mAdaptivePool) {
+            pthread_mutex_lock(&mThreadCountLock);
+            mPendingSpawnCount += mMinThreads;
+            pthread_mutex_unlock(&mThreadCountLock);
+            spawnPooledThread(true);
+            for (size_t i = 1; i < mMinThreads; i++) {
+                spawnPooledThread(false);
+            }
+        } else if (mSpawnThreadOnStart) {
             spawnPooledThread(true);
         }
     }
@@ -256,6 +298,59 @@ size_t ProcessState::getMmapSize() {
     return mMmapSize;
 }
 
+ProcessState::MmapUsage ProcessState::getMmapUsage() {
+    MmapUsage usage;
+    usage.mmapSize = mMmapSize;
+    usage.bytesInUse = mMmapBytesInUse.load(std::memory_order_relaxed);
+    usage.highWaterBytes = mMmapHighWater.load(std::memory_order_relaxed);
+    usage.pendingBuffers = mMmapPendingBuffers.load(std::memory_order_relaxed);
+    usage.failedTransactions = mFailedTransactions.load(std::memory_order_relaxed);
+    AutoMutex _l(mLargeBufferLock);
+    usage.largestPendingBytes = mLargeBuffers.empty() ? 0 : *mLargeBuffers.rbegin();
+    return usage;
+}
+
+void ProcessState::setBufferFreePolicy(size_t immediateBytes, size_t maxBatched) {
+    mImmediateFreeBytes.store(immediateBytes, std::memory_order_relaxed);
+    mMaxBatchedFrees.store(maxBatched, std::memory_order_relaxed);
+}
+
+ProcessState::BufferFreeStats ProcessState::getBufferFreeStats() {
+    BufferFreeStats stats;
+    stats.frees = mFrees.load(std::memory_order_relaxed);
+    stats.immediateFlushes = mImmediateFreeFlushes.load(std::memory_order_relaxed);
+    stats.batchFlushes = mBatchedFreeFlushes.load(std::memory_order_relaxed);
+    stats.earlyReleases = mEarlyReleases.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void ProcessState::mmapBufferReceived(size_t size) {
+    mMmapPendingBuffers.fetch_add(1, std::memory_order_relaxed);
+    const size_t inUse = mMmapBytesInUse.fetch_add(size, std::memory_order_relaxed) + size;
+    size_t highWater = mMmapHighWater.load(std::memory_order_relaxed);
+    while (inUse > highWater &&
+           !mMmapHighWater.compare_exchange_weak(highWater, inUse, std::memory_order_relaxed)) {
+    }
+    if (size >= kLargeBufferBytes) {
+        AutoMutex _l(mLargeBufferLock);
+        mLargeBuffers.insert(size);
+    }
+}
+
+void ProcessState::mmapBufferFreed(size_t size) {
+    mMmapPendingBuffers.fetch_sub(1, std::memory_order_relaxed);
+    // Don't wrap around should the estimates on receive and free disagree.
+    size_t inUse = mMmapBytesInUse.load(std::memory_order_relaxed);
+    while (!mMmapBytesInUse.compare_exchange_weak(inUse, inUse > size ? inUse - size : 0,
+                                                  std::memory_order_relaxed)) {
+    }
+    if (size >= kLargeBufferBytes) {
+        AutoMutex _l(mLargeBufferLock);
+        auto it = mLargeBuffers.find(size);
+        if (it != mLargeBuffers.end()) mLargeBuffers.erase(it);
+    }
+}
+
 void ProcessState::setCallRestriction(CallRestriction restriction) {
     LOG_ALWAYS_FATAL_IF(IPCThreadState::selfOrNull() != nullptr,
         "Call restrictions must be set before the threadpool is started.");
@@ -263,46 +358,114 @@ void ProcessState::setCallRestriction(CallRestriction restriction) {
     mCallRestriction = restriction;
 }
 
+ProcessState::handle_directory::handle_directory(size_t chunkCount)
+    : count(chunkCount)
+    , chunks(new (std::nothrow) std::atomic<handle_entry*>[chunkCount])
+{
+    if (chunks == nullptr) return;
+    for (size_t i = 0; i < count; i++) {
+        chunks[i].store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+ProcessState::handle_entry* ProcessState::lookupHandle(int32_t handle)
+{
+    if (handle < 0) return nullptr;
+    const size_t chunk = (size_t)handle / kHandleChunkSize;
+    // A chunk published after the directory was replaced is only in the
+    // new one; the caller then falls back to lookupHandleLocked().
+    handle_directory* directory = mHandleDirectory.load(std::memory_order_acquire);
+    if (chunk >= directory->count) return nullptr;
+    handle_entry* entries = directory->chunks[chunk].load(std::memory_order_acquire);
+    if (entries == nullptr) return nullptr;
+    return &entries[(size_t)handle % kHandleChunkSize];
+}
+
 ProcessState::handle_entry* ProcessState::lookupHandleLocked(int32_t handle)
 {
-    const size_t N=mHandleToObject.size();
-    if (N <= (size_t)handle) {
-        handle_entry e;
-        e.binder = nullptr;
-        e.refs = nullptr;
-        status_t err = mHandleToObject.insertAt(e, N, handle+1-N);
-        if (err < NO_ERROR) return nullptr;
+    if (handle < 0) return nullptr;
+    const size_t chunk = (size_t)handle / kHandleChunkSize;
+    handle_directory* directory = mHandleDirectory.load(std::memory_order_relaxed);
+    if (chunk >= directory->count) {
+        size_t count = directory->count;
+        while (count <= chunk) count *= 2;
+        std::unique_ptr<handle_directory> grown(new (std::nothrow) handle_directory(count));
+        if (grown == nullptr || grown->chunks == nullptr) {
+            ALOGE("Cannot grow the handle table to %zu entries", count * kHandleChunkSize);
+            return nullptr;
+        }
+        for (size_t i = 0; i < directory->count; i++) {
+            grown->chunks[i].store(directory->chunks[i].load(std::memory_order_relaxed),
+                                   std::memory_order_relaxed);
+        }
+        grown->previous.reset(directory);
+        directory = grown.release();
+        // Pairs with the acquire load in lookupHandle().
+        mHandleDirectory.store(directory, std::memory_order_release);
     }
-    return &mHandleToObject.editItemAt(handle);
+    handle_entry* entries = directory->chunks[chunk].load(std::memory_order_relaxed);
+    if (entries == nullptr) {
+        entries = new (std::nothrow) handle_entry[kHandleChunkSize];
+        if (entries == nullptr) return nullptr;
+        for (size_t i = 0; i < kHandleChunkSize; i++) {
+            entries[i].binder.store(nullptr, std::memory_order_relaxed);
+            entries[i].readers.store(0, std::memory_order_relaxed);
+        }
+        // Pairs with the acquire load in lookupHandle().
+        directory->chunks[chunk].store(entries, std::memory_order_release);
+    }
+    return &entries[(size_t)handle % kHandleChunkSize];
+}
+
+IBinder* ProcessState::acquireWeakProxy(handle_entry* e)
+{
+    // The attemptIncWeak() is safe because the BpHwBinder destructor always
+    // calls expungeHandle(), which won't return while we are registered as a
+    // reader of this entry. Both the increment and the load below must be
+    // sequentially consistent so that expungeHandle() either sees us or we
+    // see its cleared pointer.
+    e->readers.fetch_add(1);
+    IBinder* b = e->binder.load();
+    if (b != nullptr && !b->getWeakRefs()->attemptIncWeak(this)) {
+        b = nullptr;
+    }
+    e->readers.fetch_sub(1, std::memory_order_release);
+    return b;
 }
 
 sp<IBinder> ProcessState::getStrongProxyForHandle(int32_t handle)
 {
     sp<IBinder> result;
 
-    AutoMutex _l(mLock);
+    // Fast path: an existing proxy can be picked up without taking any lock.
+    handle_entry* e = lookupHandle(handle);
+    IBinder* b = e != nullptr ? acquireWeakProxy(e) : nullptr;
+
+    if (b == nullptr) {
+        AutoMutex _l(mHandleLock);
 
-    handle_entry* e = lookupHandleLocked(handle);
+        e = lookupHandleLocked(handle);
+        if (e == nullptr) return result;
 
-    if (e != nullptr) {
         // We need to create a new BpHwBinder if there isn't currently one, OR we
         // are unable to acquire a weak reference on this current one.  See comment
-        // in getWeakProxyForHandle() for more info about this.
-        IBinder* b = e->binder;
-        if (b == nullptr || !e->refs->attemptIncWeak(this)) {
+        // in getWeakProxyForHandle() for more info about this. Someone else may
+        // have created one since the fast path looked.
+        b = acquireWeakProxy(e);
+        if (b == nullptr) {
             b = new BpHwBinder(handle);
-            e->binder = b;
-            if (b) e->refs = b->getWeakRefs();
+            e->binder.store(b);
             result = b;
-        } else {
-            // This little bit of nastyness is to allow us to add a primary
-            // reference to the remote proxy when this team doesn't have one
-            // but another team is sending the handle to us.
-            result.force_set(b);
-            e->refs->decWeak(this);
+            return result;
         }
     }
 
+    // This little bit of nastyness is to allow us to add a primary
+    // reference to the remote proxy when this team doesn't have one
+    // but another team is sending the handle to us.
+    result.force_set(b);
+    b->getWeakRefs()->decWeak(this);
+
     return result;
 }
 
@@ -310,43 +473,54 @@ wp<IBinder> ProcessState::getWeakProxyForHandle(int32_t handle)
 {
     wp<IBinder> result;
 
-    AutoMutex _l(mLock);
+    handle_entry* e = lookupHandle(handle);
+    IBinder* b = e != nullptr ? acquireWeakProxy(e) : nullptr;
 
-    handle_entry* e = lookupHandleLocked(handle);
+    if (b == nullptr) {
+        AutoMutex _l(mHandleLock);
+
+        e = lookupHandleLocked(handle);
+        if (e == nullptr) return result;
 
-    if (e != nullptr) {
         // We need to create a new BpHwBinder if there isn't currently one, OR we
-        // are unable to acquire a weak reference on this current one.  The
-        // attemptIncWeak() is safe because we know the BpHwBinder destructor will always
-        // call expungeHandle(), which acquires the same lock we are holding now.
-        // We need to do this because there is a race condition between someone
-        // releasing a reference on this BpHwBinder, and a new reference on its handle
+        // are unable to acquire a weak reference on this current one. We need to
+        // do this because there is a race condition between someone releasing a
+        // reference on this BpHwBinder, and a new reference on its handle
         // arriving from the driver.
-        IBinder* b = e->binder;
-        if (b == nullptr || !e->refs->attemptIncWeak(this)) {
+        b = acquireWeakProxy(e);
+        if (b == nullptr) {
             b = new BpHwBinder(handle);
             result = b;
-            e->binder = b;
-            if (b) e->refs = b->getWeakRefs();
-        } else {
-            result = b;
-            e->refs->decWeak(this);
+            e->binder.store(b);
+            return result;
         }
     }
 
+    result = b;
+    b->getWeakRefs()->decWeak(this);
+
     return result;
 }
 
 void ProcessState::expungeHandle(int32_t handle, IBinder* binder)
 {
-    AutoMutex _l(mLock);
+    AutoMutex _l(mHandleLock);
 
-    handle_entry* e = lookupHandleLocked(handle);
+    handle_entry* e = lookupHandle(handle);
+    if (e == nullptr) return;
 
     // This handle may have already been replaced with a new BpHwBinder
     // (if someone failed the AttemptIncWeak() above); we don't want
     // to overwrite it.
-    if (e && e->binder == binder) e->binder = nullptr;
+    IBinder* expected = binder;
+    e->binder.compare_exchange_strong(expected, nullptr);
+
+    // A lock-free reader may still be about to call attemptIncWeak() on the
+    // pointer it loaded before we got here; the object has to stay alive
+    // until it is done.
+    while (e->readers.load() != 0) {
+        sched_yield();
+    }
 }
 
 String8 ProcessState::makeBinderThreadName() {
@@ -405,6 +579,243 @@ size_t ProcessState::getMaxThreads() {
     return mMaxThreads;
 }
 
+status_t ProcessState::setThreadPoolAdaptive(size_t minThreads, size_t maxThreads,
+                                             uint32_t idleTimeoutMs) {
+    if (minThreads == 0 || maxThreads < minThreads) {
+        ALOGE("Invalid adaptive threadpool range [%zu, %zu]", minThreads, maxThreads);
+        return BAD_VALUE;
+    }
+
+    AutoMutex _l(mLock);
+    if (mThreadPoolStarted) {
+        ALOGE("Adaptive threadpool must be configured before the threadpool is started.");
+        return INVALID_OPERATION;
+    }
+
+    // All threads are spawned from userspace in this mode, so the kernel
+    // must never ask for more.
+    size_t kernelMaxThreads = 0;
+    if (ioctl(mDriverFD, BINDER_SET_MAX_THREADS, &kernelMaxThreads) == -1) {
+        ALOGE("Binder ioctl to set max threads failed: %s", strerror(errno));
+        return -errno;
+    }
+
+    pthread_mutex_lock(&mThreadCountLock);
+    mAdaptivePool = true;
+    mMinThreads = minThreads;
+    mMaxThreads = maxThreads;
+    mIdleTimeoutMs = idleTimeoutMs;
+    pthread_mutex_unlock(&mThreadCountLock);
+
+    return NO_ERROR;
+}
+
+status_t ProcessState::setThreadPoolAffinity(const cpu_set_t& cpus) {
+    if (CPU_COUNT(&cpus) == 0) {
+        ALOGE("Binder threadpool affinity must contain at least one CPU.");
+        return BAD_VALUE;
+    }
+
+    AutoMutex _l(mLock);
+    mPoolAffinity = cpus;
+    mPoolAffinitySet = true;
+    return NO_ERROR;
+}
+
+status_t ProcessState::setThreadPoolSchedPolicy(int policy, int priority) {
+    if (policy == SCHED_FIFO || policy == SCHED_RR) {
+        if (priority < sched_get_priority_min(policy) ||
+            priority > sched_get_priority_max(policy)) {
+            return BAD_VALUE;
+        }
+    } else if (policy == SCHED_NORMAL) {
+        if (priority < -20 || priority > 19) return BAD_VALUE;
+    } else {
+        return BAD_VALUE;
+    }
+
+    AutoMutex _l(mLock);
+    mPoolSchedPolicy = policy;
+    mPoolSchedPriority = priority;
+    mPoolSchedSet = true;
+    return NO_ERROR;
+}
+
+void ProcessState::configurePooledThread() {
+    AutoMutex _l(mLock);
+    if (mPoolAffinitySet &&
+        sched_setaffinity(0, sizeof(mPoolAffinity), &mPoolAffinity) != 0) {
+        ALOGW("Failed to set binder thread affinity: %s", strerror(errno));
+    }
+    if (mPoolSchedSet) {
+        struct sched_param param = {
+            .sched_priority = mPoolSchedPolicy == SCHED_NORMAL ? 0 : mPoolSchedPriority,
+        };
+        if (sched_setscheduler(0, mPoolSchedPolicy | SCHED_RESET_ON_FORK, &param) != 0) {
+            ALOGW("Failed to set binder thread policy %d: %s", mPoolSchedPolicy,
+                  strerror(errno));
+        } else if (mPoolSchedPolicy == SCHED_NORMAL &&
+                   setpriority(PRIO_PROCESS, 0, mPoolSchedPriority) != 0) {
+            ALOGW("Failed to set binder thread priority %d: %s", mPoolSchedPriority,
+                  strerror(errno));
+        }
+    }
+}
+
+void ProcessState::setThreadPoolProfiling(bool enabled) {
+    pthread_mutex_lock(&mThreadCountLock);
+    if (enabled && !mPoolProfiling.load(std::memory_order_relaxed)) {
+        const int64_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        mProfileStartNs = now;
+        mOccupancyLastNs = now;
+        mOccupancyIntegral = 0;
+        mQueueingNs = 0;
+        mMaxQueueingNs = 0;
+        mPeakExecutingThreads = mExecutingThreadsCount;
+        mExitedBusyNs = 0;
+        mExitedIdleNs = 0;
+        mExitedCommands = 0;
+        for (PoolThreadProfile* profile : mPoolThreadProfiles) {
+            profile->busyNs.store(0, std::memory_order_relaxed);
+            profile->idleNs.store(0, std::memory_order_relaxed);
+            profile->commands.store(0, std::memory_order_relaxed);
+        }
+    }
+    mPoolProfiling.store(enabled, std::memory_order_relaxed);
+    pthread_mutex_unlock(&mThreadCountLock);
+}
+
+ProcessState::ThreadPoolStats ProcessState::getThreadPoolStats() {
+    ThreadPoolStats stats;
+    pthread_mutex_lock(&mThreadCountLock);
+    const int64_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    stats.maxThreads = mMaxThreads;
+    stats.executingThreads = mExecutingThreadsCount;
+    stats.peakExecutingThreads = mPeakExecutingThreads;
+    if (mProfileStartNs != 0) {
+        stats.profileNs = now - mProfileStartNs;
+        const double integral = mPoolProfiling.load(std::memory_order_relaxed)
+                ? mOccupancyIntegral + (double)mExecutingThreadsCount * (now - mOccupancyLastNs)
+                : mOccupancyIntegral;
+        const int64_t span = mPoolProfiling.load(std::memory_order_relaxed)
+                ? now - mProfileStartNs : mOccupancyLastNs - mProfileStartNs;
+        stats.averageExecutingThreads = span > 0 ? integral / span : 0;
+    } else {
+        stats.profileNs = 0;
+        stats.averageExecutingThreads = 0;
+    }
+    stats.busyNs = mExitedBusyNs;
+    stats.idleNs = mExitedIdleNs;
+    stats.commands = mExitedCommands;
+    for (const PoolThreadProfile* profile : mPoolThreadProfiles) {
+        PoolThreadStats thread;
+        thread.tid = profile->tid;
+        thread.busyNs = profile->busyNs.load(std::memory_order_relaxed);
+        thread.idleNs = profile->idleNs.load(std::memory_order_relaxed);
+        thread.commands = profile->commands.load(std::memory_order_relaxed);
+        stats.busyNs += thread.busyNs;
+        stats.idleNs += thread.idleNs;
+        stats.commands += thread.commands;
+        stats.threads.push_back(thread);
+    }
+    stats.queueingNs = mQueueingNs;
+    stats.maxQueueingNs = mMaxQueueingNs;
+    stats.starvationCount = mStarvationCount;
+    stats.starvationMs = mStarvationTotalMs;
+    stats.longestStarvationMs = mLongestStarvationMs;
+    // A period still going on counts up to now.
+    if (mStarvationStartTimeMs != 0) {
+        const uint64_t ongoingMs = uptimeMillis() - mStarvationStartTimeMs;
+        stats.starvationCount++;
+        stats.starvationMs += ongoingMs;
+        stats.longestStarvationMs = std::max(stats.longestStarvationMs, ongoingMs);
+    }
+    pthread_mutex_unlock(&mThreadCountLock);
+    return stats;
+}
+
+void ProcessState::poolThreadJoined(PoolThreadProfile* profile) {
+    pthread_mutex_lock(&mThreadCountLock);
+    mPoolThreadProfiles.push_back(profile);
+    pthread_mutex_unlock(&mThreadCountLock);
+}
+
+void ProcessState::poolThreadLeft(PoolThreadProfile* profile) {
+    pthread_mutex_lock(&mThreadCountLock);
+    for (auto it = mPoolThreadProfiles.begin(); it != mPoolThreadProfiles.end(); ++it) {
+        if (*it == profile) {
+            mPoolThreadProfiles.erase(it);
+            mExitedBusyNs += profile->busyNs.load(std::memory_order_relaxed);
+            mExitedIdleNs += profile->idleNs.load(std::memory_order_relaxed);
+            mExitedCommands += profile->commands.load(std::memory_order_relaxed);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mThreadCountLock);
+}
+
+void ProcessState::poolOccupancyChangingLocked(int64_t nowNs) {
+    // Threads that were executing before profiling started are counted
+    // from its start on.
+    if (nowNs > mOccupancyLastNs) {
+        mOccupancyIntegral += (double)mExecutingThreadsCount * (nowNs - mOccupancyLastNs);
+        mOccupancyLastNs = nowNs;
+    }
+}
+
+void ProcessState::poolCommandStartingLocked(int64_t queueingNs) {
+    if (queueingNs <= 0) return;
+    mQueueingNs += queueingNs;
+    mMaxQueueingNs = std::max(mMaxQueueingNs, (uint64_t)queueingNs);
+}
+
+void ProcessState::poolStarvationEndedLocked(int64_t starvationMs) {
+    mStarvationCount++;
+    mStarvationTotalMs += starvationMs;
+    mLongestStarvationMs = std::max(mLongestStarvationMs, (uint64_t)starvationMs);
+}
+
+void ProcessState::pooledThreadStarted() {
+    pthread_mutex_lock(&mThreadCountLock);
+    if (mPendingSpawnCount > 0) mPendingSpawnCount--;
+    pthread_mutex_unlock(&mThreadCountLock);
+}
+
+void ProcessState::adaptiveLooperJoined() {
+    pthread_mutex_lock(&mThreadCountLock);
+    mLooperCount++;
+    pthread_mutex_unlock(&mThreadCountLock);
+}
+
+void ProcessState::adaptiveLooperLeft() {
+    pthread_mutex_lock(&mThreadCountLock);
+    if (mLooperCount > 0) mLooperCount--;
+    pthread_mutex_unlock(&mThreadCountLock);
+}
+
+bool ProcessState::adaptiveShouldSpawnLocked() {
+    // Spawn as soon as the last idle looper picks up work, so that there is
+    // already a thread waiting when the next transaction arrives.
+    const size_t available = mLooperCount + mPendingSpawnCount;
+    if (mExecutingThreadsCount < available || available >= mMaxThreads) {
+        return false;
+    }
+    mPendingSpawnCount++;
+    return true;
+}
+
+bool ProcessState::tryReapIdleLooper() {
+    // On success the caller is no longer counted and must leave the pool.
+    bool reap = false;
+    pthread_mutex_lock(&mThreadCountLock);
+    if (mLooperCount > mMinThreads) {
+        mLooperCount--;
+        reap = true;
+    }
+    pthread_mutex_unlock(&mThreadCountLock);
+    return reap;
+}
+
 void ProcessState::giveThreadPoolName() {
     androidSetThreadName( makeBinderThreadName().string() );
 }
@@ -443,15 +854,52 @@ ProcessState::ProcessState(size_t mmapSize)
     , mExecutingThreadsCount(0)
     , mMaxThreads(DEFAULT_MAX_BINDER_THREADS)
     , mStarvationStartTimeMs(0)
+    , mStarvationCount(0)
+    , mStarvationTotalMs(0)
+    , mLongestStarvationMs(0)
+    , mPeakExecutingThreads(0)
+    , mPoolProfiling(false)
+    , mProfileStartNs(0)
+    , mOccupancyLastNs(0)
+    , mOccupancyIntegral(0)
+    , mQueueingNs(0)
+    , mMaxQueueingNs(0)
+    , mExitedBusyNs(0)
+    , mExitedIdleNs(0)
+    , mExitedCommands(0)
+    , mAdaptivePool(false)
+    , mMinThreads(0)
+    , mIdleTimeoutMs(0)
+    , mLooperCount(0)
+    , mPendingSpawnCount(0)
     , mManagesContexts(false)
     , mBinderContextCheckFunc(nullptr)
     , mBinderContextUserData(nullptr)
+    , mPoolAffinitySet(false)
+    , mPoolSchedSet(false)
+    , mPoolSchedPolicy(SCHED_NORMAL)
+    , mPoolSchedPriority(0)
     , mThreadPoolStarted(false)
     , mSpawnThreadOnStart(true)
     , mThreadPoolSeq(1)
     , mMmapSize(mmapSize)
+    , mMmapBytesInUse(0)
+    , mMmapHighWater(0)
+    , mMmapPendingBuffers(0)
+    , mFailedTransactions(0)
+    , mImmediateFreeBytes(0)
+    , mMaxBatchedFrees(0)
+    , mFrees(0)
+    , mImmediateFreeFlushes(0)
+    , mBatchedFreeFlushes(0)
+    , mEarlyReleases(0)
     , mCallRestriction(CallRestriction::NONE)
 {
+    handle_directory* directory = new handle_directory(kInitialHandleChunkCount);
+    LOG_ALWAYS_FATAL_IF(directory->chunks == nullptr, "Cannot allocate the handle table");
+    mHandleDirectory.store(directory, std::memory_order_relaxed);
+    CPU_ZERO(&mPoolAffinity);
+
     if (mDriverFD >= 0) {
         // mmap the binder, providing a chunk of virtual address space to receive transactions.
         mVMStart = mmap(nullptr, mMmapSize, PROT_READ, MAP_PRIVATE | MAP_NORESERVE, mDriverFD, 0);
@@ -477,6 +925,14 @@ ProcessState::~ProcessState()
         close(mDriverFD);
     }
     mDriverFD = -1;
+
+    // The current directory holds every chunk; the ones it replaced only
+    // hold a subset of the same pointers.
+    handle_directory* directory = mHandleDirectory.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < directory->count; i++) {
+        delete[] directory->chunks[i].load(std::memory_order_relaxed);
+    }
+    delete directory;
 }
 
 } // namespace hardware
@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hw-TransactionRecorder"
+
+#include <hwbinder/TransactionRecorder.h>
+
+#include <hwbinder/Parcel.h>
+#include <utils/Log.h>
+#include <utils/threads.h>
+
+#include "binder_kernel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <new>
+
+namespace android {
+namespace hardware {
+
+std::atomic<bool> TransactionRecorder::sRecording(false);
+
+// ---------------------------------------------------------------------------
+
+namespace {
+
+struct Capture {
+    int                                 fd;
+    uint8_t*                            map;
+    size_t                              mapSize;
+    TransactionRecorder::FileHeader*    header;
+    uint8_t*                            ring;
+    uint64_t                            ringSize;
+};
+
+Mutex gCaptureLock;     // serializes start() and stop()
+Capture* gCapture = nullptr;
+// Threads inside record(); stop() waits for them before unmapping.
+std::atomic<uint32_t> gWriters(0);
+
+inline uint64_t align8(uint64_t v)
+{
+    return (v + 7) & ~(uint64_t)7;
+}
+
+void copyToRing(uint8_t* ring, uint64_t ringSize, uint64_t pos, const void* src, size_t len)
+{
+    const uint64_t offset = pos % ringSize;
+    const size_t first = (size_t)std::min<uint64_t>(len, ringSize - offset);
+    memcpy(ring + offset, src, first);
+    if (first < len) {
+        memcpy(ring, reinterpret_cast<const uint8_t*>(src) + first, len - first);
+    }
+}
+
+void copyFromRing(const uint8_t* ring, uint64_t ringSize, uint64_t pos, void* dst, size_t len)
+{
+    const uint64_t offset = pos % ringSize;
+    const size_t first = (size_t)std::min<uint64_t>(len, ringSize - offset);
+    memcpy(dst, ring + offset, first);
+    if (first < len) {
+        memcpy(reinterpret_cast<uint8_t*>(dst) + first, ring, len - first);
+    }
+}
+
+// The scatter-gather buffer an object refers to, or nullptr if it is not one.
+const binder_buffer_object* bufferAt(const uint8_t* data, size_t dataSize, uint64_t offset)
+{
+    if (offset > dataSize || dataSize - offset < sizeof(binder_buffer_object)) return nullptr;
+    const binder_buffer_object* obj =
+            reinterpret_cast<const binder_buffer_object*>(data + offset);
+    if (obj->hdr.type != BINDER_TYPE_PTR || obj->buffer == 0) return nullptr;
+    return obj;
+}
+
+} // namespace
+
+// ---------------------------------------------------------------------------
+
+status_t TransactionRecorder::start(const char* path, size_t ringSize)
+{
+    AutoMutex _l(gCaptureLock);
+    if (gCapture != nullptr) return INVALID_OPERATION;
+
+    const size_t page = sysconf(_SC_PAGE_SIZE);
+    if (ringSize == 0 || ringSize > SIZE_MAX - 2 * page) return BAD_VALUE;
+    ringSize = (ringSize + page - 1) & ~(page - 1);
+    const size_t mapSize = page + ringSize;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ALOGE("Cannot create transaction capture %s: %s", path, strerror(errno));
+        return -errno;
+    }
+    if (ftruncate(fd, mapSize) != 0) {
+        const status_t err = -errno;
+        ALOGE("Cannot size transaction capture %s: %s", path, strerror(errno));
+        close(fd);
+        return err;
+    }
+    // Populated up front so that recording never takes a page fault.
+    void* map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (map == MAP_FAILED) {
+        const status_t err = -errno;
+        ALOGE("Cannot map transaction capture %s: %s", path, strerror(errno));
+        close(fd);
+        return err;
+    }
+
+    Capture* capture = new (std::nothrow) Capture();
+    if (capture == nullptr) {
+        munmap(map, mapSize);
+        close(fd);
+        return NO_MEMORY;
+    }
+    capture->fd = fd;
+    capture->map = reinterpret_cast<uint8_t*>(map);
+    capture->mapSize = mapSize;
+    capture->header = new (map) FileHeader();
+    capture->header->magic = kFileMagic;
+    capture->header->version = kFileVersion;
+    capture->header->ringOffset = page;
+    capture->header->ringSize = ringSize;
+    capture->header->writePos.store(0, std::memory_order_relaxed);
+    capture->header->dropped.store(0, std::memory_order_relaxed);
+    capture->header->pid = getpid();
+    capture->ring = capture->map + page;
+    capture->ringSize = ringSize;
+
+    gCapture = capture;
+    sRecording.store(true);
+    return NO_ERROR;
+}
+
+void TransactionRecorder::stop()
+{
+    AutoMutex _l(gCaptureLock);
+    if (gCapture == nullptr) return;
+
+    sRecording.store(false);
+    while (gWriters.load() != 0) {
+        sched_yield();
+    }
+
+    Capture* capture = gCapture;
+    gCapture = nullptr;
+    msync(capture->map, capture->mapSize, MS_SYNC);
+    munmap(capture->map, capture->mapSize);
+    close(capture->fd);
+    delete capture;
+}
+
+void TransactionRecorder::capture(uintptr_t data, size_t dataSize, uintptr_t objects,
+                                  size_t objectsCount, Record* request)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    const binder_size_t* offsets = reinterpret_cast<const binder_size_t*>(objects);
+
+    request->data.assign(bytes, bytes + dataSize);
+    request->objects.assign(offsets, offsets + objectsCount);
+    request->buffers.clear();
+    for (size_t i = 0; i < objectsCount; i++) {
+        const binder_buffer_object* obj = bufferAt(bytes, dataSize, offsets[i]);
+        if (obj == nullptr) continue;
+        const uint8_t* buffer = reinterpret_cast<const uint8_t*>(obj->buffer);
+        request->buffers.emplace_back(buffer, buffer + obj->length);
+    }
+}
+
+void TransactionRecorder::record(Direction direction, uint64_t target, uint32_t code,
+                                 uint32_t flags, const Parcel& parcel,
+                                 int64_t startNs, int64_t durationNs, status_t status)
+{
+    append(direction, target, code, flags,
+           reinterpret_cast<const uint8_t*>(parcel.ipcData()), parcel.ipcDataSize(),
+           reinterpret_cast<const binder_size_t*>(parcel.ipcObjects()),
+           parcel.ipcObjectsCount(), nullptr, startNs, durationNs, status);
+}
+
+void TransactionRecorder::record(Direction direction, uint64_t target, uint32_t code,
+                                 uint32_t flags, const Record& request,
+                                 int64_t startNs, int64_t durationNs, status_t status)
+{
+    append(direction, target, code, flags, request.data.data(), request.data.size(),
+           request.objects.data(), request.objects.size(), &request.buffers,
+           startNs, durationNs, status);
+}
+
+template <typename Offset>
+void TransactionRecorder::append(Direction direction, uint64_t target, uint32_t code,
+                                 uint32_t flags, const uint8_t* data, size_t dataSize,
+                                 const Offset* objects, size_t objectsCount,
+                                 const std::vector<std::vector<uint8_t>>* buffers,
+                                 int64_t startNs, int64_t durationNs, status_t status)
+{
+    // Pairs with stop(): either it sees this thread as a writer, or this
+    // thread sees that recording has stopped.
+    gWriters.fetch_add(1);
+    if (!sRecording.load()) {
+        gWriters.fetch_sub(1, std::memory_order_release);
+        return;
+    }
+    Capture* capture = gCapture;
+
+    uint64_t buffersSize = 0;
+    if (buffers != nullptr) {
+        for (const std::vector<uint8_t>& buffer : *buffers) {
+            buffersSize += align8(buffer.size());
+        }
+    } else {
+        for (size_t i = 0; i < objectsCount; i++) {
+            const binder_buffer_object* obj = bufferAt(data, dataSize, objects[i]);
+            if (obj != nullptr) buffersSize += align8(obj->length);
+        }
+    }
+    const uint64_t size = sizeof(RecordHeader) + align8(dataSize) +
+            objectsCount * sizeof(uint64_t) + buffersSize;
+    if (size > capture->ringSize / 4) {
+        capture->header->dropped.fetch_add(1, std::memory_order_relaxed);
+        gWriters.fetch_sub(1, std::memory_order_release);
+        return;
+    }
+
+    const uint64_t pos = capture->header->writePos.fetch_add(size, std::memory_order_relaxed);
+
+    RecordHeader hdr = {};
+    hdr.position = UINT64_MAX;
+    hdr.size = (uint32_t)size;
+    hdr.direction = direction;
+    hdr.target = target;
+    hdr.code = code;
+    hdr.flags = flags;
+    hdr.status = status;
+    hdr.tid = gettid();
+    hdr.startNs = (uint64_t)startNs;
+    hdr.durationNs = (uint64_t)durationNs;
+    hdr.dataSize = (uint32_t)dataSize;
+    hdr.objectsCount = (uint32_t)objectsCount;
+    hdr.buffersSize = (uint32_t)buffersSize;
+
+    uint8_t* const ring = capture->ring;
+    const uint64_t ringSize = capture->ringSize;
+    uint64_t cursor = pos;
+    copyToRing(ring, ringSize, cursor, &hdr, sizeof(hdr));
+    cursor += sizeof(hdr);
+    if (dataSize > 0) {
+        copyToRing(ring, ringSize, cursor, data, dataSize);
+    }
+    cursor += align8(dataSize);
+    for (size_t i = 0; i < objectsCount; i++) {
+        const uint64_t offset = objects[i];
+        copyToRing(ring, ringSize, cursor, &offset, sizeof(offset));
+        cursor += sizeof(offset);
+    }
+    if (buffers != nullptr) {
+        for (const std::vector<uint8_t>& buffer : *buffers) {
+            copyToRing(ring, ringSize, cursor, buffer.data(), buffer.size());
+            cursor += align8(buffer.size());
+        }
+    } else {
+        for (size_t i = 0; i < objectsCount; i++) {
+            const binder_buffer_object* obj = bufferAt(data, dataSize, objects[i]);
+            if (obj == nullptr) continue;
+            copyToRing(ring, ringSize, cursor, reinterpret_cast<const void*>(obj->buffer),
+                       obj->length);
+            cursor += align8(obj->length);
+        }
+    }
+
+    // Records are 8-byte aligned in a ring of whole pages, so the position
+    // never straddles the end.
+    __atomic_store_n(reinterpret_cast<uint64_t*>(ring + pos % ringSize), pos,
+                     __ATOMIC_RELEASE);
+    gWriters.fetch_sub(1, std::memory_order_release);
+}
+
+status_t TransactionRecorder::read(const char* path, std::vector<Record>* records)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -errno;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        const status_t err = -errno;
+        close(fd);
+        return err;
+    }
+    const size_t fileSize = st.st_size;
+    if (fileSize < sizeof(FileHeader)) {
+        close(fd);
+        return BAD_VALUE;
+    }
+    void* map = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -errno;
+
+    const uint8_t* base = reinterpret_cast<const uint8_t*>(map);
+    const FileHeader* header = reinterpret_cast<const FileHeader*>(base);
+    if (header->magic != kFileMagic || header->version != kFileVersion ||
+        header->ringOffset < sizeof(FileHeader) || header->ringSize == 0 ||
+        header->ringSize % 8 != 0 || header->ringOffset > fileSize ||
+        header->ringSize > fileSize - header->ringOffset) {
+        munmap(map, fileSize);
+        return BAD_VALUE;
+    }
+    const uint8_t* ring = base + header->ringOffset;
+    const uint64_t ringSize = header->ringSize;
+    const uint64_t end = header->writePos.load(std::memory_order_relaxed);
+    uint64_t pos = align8(end > ringSize ? end - ringSize : 0);
+
+    // The oldest bytes may be the tail of an overwritten record, so look for
+    // the first header that sits where it says it does.
+    while (pos + sizeof(RecordHeader) <= end) {
+        RecordHeader hdr;
+        copyFromRing(ring, ringSize, pos, &hdr, sizeof(hdr));
+        const uint64_t expected = sizeof(RecordHeader) + align8(hdr.dataSize) +
+                (uint64_t)hdr.objectsCount * sizeof(uint64_t) + hdr.buffersSize;
+        if (hdr.position != pos || hdr.size != expected || hdr.size > end - pos) {
+            pos += 8;
+            continue;
+        }
+
+        Record record;
+        record.header = hdr;
+        uint64_t cursor = pos + sizeof(RecordHeader);
+        record.data.resize(hdr.dataSize);
+        copyFromRing(ring, ringSize, cursor, record.data.data(), hdr.dataSize);
+        cursor += align8(hdr.dataSize);
+        record.objects.resize(hdr.objectsCount);
+        copyFromRing(ring, ringSize, cursor, record.objects.data(),
+                     hdr.objectsCount * sizeof(uint64_t));
+        cursor += hdr.objectsCount * sizeof(uint64_t);
+
+        uint64_t buffersLeft = hdr.buffersSize;
+        bool valid = true;
+        for (uint64_t offset : record.objects) {
+            const binder_buffer_object* obj =
+                    bufferAt(record.data.data(), record.data.size(), offset);
+            if (obj == nullptr) continue;
+            if (align8(obj->length) > buffersLeft) {
+                valid = false;
+                break;
+            }
+            std::vector<uint8_t> buffer(obj->length);
+            copyFromRing(ring, ringSize, cursor, buffer.data(), obj->length);
+            record.buffers.push_back(std::move(buffer));
+            cursor += align8(obj->length);
+            buffersLeft -= align8(obj->length);
+        }
+        if (valid) {
+            records->push_back(std::move(record));
+        }
+        pos += hdr.size;
+    }
+
+    munmap(map, fileSize);
+    return NO_ERROR;
+}
+
+} // namespace hardware
+} // namespace android
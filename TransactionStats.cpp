@@ -0,0 +1,379 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hw-TransactionStats"
+
+#include <hwbinder/TransactionStats.h>
+
+#include <hwbinder/Parcel.h>
+#include <hwbinder/TextOutput.h>
+#include <utils/Log.h>
+#include <utils/threads.h>
+
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <new>
+#include <set>
+#include <tuple>
+
+namespace android {
+namespace hardware {
+
+static_assert(TransactionStats::kBucketCount ==
+              (40 - 1) << TransactionStats::kSubBucketBits,
+              "buckets must cover values below 2^40");
+
+std::atomic<bool> TransactionStats::sEnabled(false);
+
+// ---------------------------------------------------------------------------
+
+TransactionStats::Histogram::Histogram()
+    : count(0), sum(0), max(0)
+{
+    memset(buckets, 0, sizeof(buckets));
+}
+
+void TransactionStats::Histogram::add(uint64_t value)
+{
+    count++;
+    sum += value;
+    max = std::max(max, value);
+    buckets[bucketOf(value)]++;
+}
+
+void TransactionStats::Histogram::merge(const Histogram& other)
+{
+    count += other.count;
+    sum += other.sum;
+    max = std::max(max, other.max);
+    for (size_t i = 0; i < kBucketCount; i++) {
+        buckets[i] += other.buckets[i];
+    }
+}
+
+uint64_t TransactionStats::Histogram::percentile(double p) const
+{
+    if (count == 0) return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * (double)count);
+    if (rank >= count) rank = count - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBucketCount; i++) {
+        seen += buckets[i];
+        if (seen > rank) return bucketLowerBound(i);
+    }
+    return max;
+}
+
+size_t TransactionStats::Histogram::bucketOf(uint64_t value)
+{
+    const uint64_t linear = 1ull << kSubBucketBits;
+    if (value < linear) return (size_t)value;
+    const size_t msb = 63 - __builtin_clzll(value);
+    const size_t sub = (value >> (msb - kSubBucketBits)) & (linear - 1);
+    const size_t bucket = ((msb - kSubBucketBits + 1) << kSubBucketBits) + sub;
+    return std::min(bucket, kBucketCount - 1);
+}
+
+uint64_t TransactionStats::Histogram::bucketLowerBound(size_t bucket)
+{
+    const uint64_t linear = 1ull << kSubBucketBits;
+    if (bucket < linear) return bucket;
+    const size_t msb = (bucket >> kSubBucketBits) + kSubBucketBits - 1;
+    const uint64_t sub = bucket & (linear - 1);
+    return (linear | sub) << (msb - kSubBucketBits);
+}
+
+// ---------------------------------------------------------------------------
+
+namespace {
+
+// Written only by the owning thread, so plain loads and stores suffice; they
+// are atomic so that snapshot() may read them concurrently.
+struct Counters {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+    std::atomic<uint64_t> buckets[TransactionStats::kBucketCount];
+
+    void add(uint64_t value) {
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        sum.store(sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        if (value > max.load(std::memory_order_relaxed)) {
+            max.store(value, std::memory_order_relaxed);
+        }
+        std::atomic<uint64_t>& b = buckets[TransactionStats::Histogram::bucketOf(value)];
+        b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    void readInto(TransactionStats::Histogram* h) const {
+        h->count = count.load(std::memory_order_relaxed);
+        h->sum = sum.load(std::memory_order_relaxed);
+        h->max = max.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < TransactionStats::kBucketCount; i++) {
+            h->buckets[i] = buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+};
+
+typedef std::tuple<int, std::string, uint32_t> EntryKey;
+
+struct Registry {
+    Mutex                                       lock;
+    std::set<std::string>                       descriptors;
+    std::vector<TransactionStatsRecorder*>      recorders;
+    std::map<EntryKey, TransactionStats::Entry> retired;
+    uint64_t                                    retiredDropped = 0;
+};
+
+// Never destroyed, so that threads still recording during exit stay safe.
+Registry& registry()
+{
+    static Registry* sRegistry = new Registry();
+    return *sRegistry;
+}
+
+void mergeEntry(std::map<EntryKey, TransactionStats::Entry>* merged,
+                const TransactionStats::Entry& entry)
+{
+    EntryKey key(entry.side, entry.descriptor, entry.code);
+    auto it = merged->find(key);
+    if (it == merged->end()) {
+        merged->emplace(key, entry);
+        return;
+    }
+    it->second.latencyNs.merge(entry.latencyNs);
+    it->second.requestBytes.merge(entry.requestBytes);
+    it->second.replyBytes.merge(entry.replyBytes);
+}
+
+// The interface token that starts every HIDL request; empty if there is none.
+void readDescriptor(const Parcel& request, const char** str, size_t* len)
+{
+    const char* data = reinterpret_cast<const char*>(request.data());
+    const size_t size = request.dataSize();
+    const size_t n = data != nullptr ? strnlen(data, size) : size;
+    if (n == size) {
+        *str = "";
+        *len = 0;
+    } else {
+        *str = data;
+        *len = n;
+    }
+}
+
+} // namespace
+
+struct TransactionStatsRecorder::Slot {
+    TransactionStats::Side  side;
+    uintptr_t               target;
+    uint32_t                code;
+    // Interned; stays valid for the life of the process.
+    const char*             descriptor;
+    size_t                  descriptorLen;
+
+    Counters                latencyNs;
+    Counters                requestBytes;
+    Counters                replyBytes;
+};
+
+// ---------------------------------------------------------------------------
+
+void TransactionStats::setEnabled(bool enabled)
+{
+    sEnabled.store(enabled, std::memory_order_relaxed);
+}
+
+std::vector<TransactionStats::Entry> TransactionStats::snapshot()
+{
+    Registry& r = registry();
+    std::map<EntryKey, Entry> merged;
+    {
+        AutoMutex _l(r.lock);
+        merged = r.retired;
+        std::vector<Entry> entries;
+        for (const TransactionStatsRecorder* recorder : r.recorders) {
+            entries.clear();
+            recorder->collect(&entries);
+            for (const Entry& entry : entries) {
+                mergeEntry(&merged, entry);
+            }
+        }
+    }
+
+    std::vector<Entry> result;
+    result.reserve(merged.size());
+    for (auto& it : merged) {
+        result.push_back(std::move(it.second));
+    }
+    return result;
+}
+
+uint64_t TransactionStats::droppedCount()
+{
+    Registry& r = registry();
+    AutoMutex _l(r.lock);
+    uint64_t dropped = r.retiredDropped;
+    for (const TransactionStatsRecorder* recorder : r.recorders) {
+        dropped += recorder->mDropped.load(std::memory_order_relaxed);
+    }
+    return dropped;
+}
+
+void TransactionStats::dump(TextOutput& out)
+{
+    const std::vector<Entry> entries = snapshot();
+    if (entries.empty()) {
+        out << "No transaction stats recorded." << endl;
+    }
+    for (const Entry& entry : entries) {
+        const Histogram& latency = entry.latencyNs;
+        out << (entry.side == CLIENT ? "client " : "server ")
+            << (entry.descriptor.empty() ? "<no descriptor>" : entry.descriptor.c_str())
+            << " code " << entry.code << ": " << latency.count << " calls, latency ns"
+            << " p50 " << latency.percentile(50) << " p90 " << latency.percentile(90)
+            << " p99 " << latency.percentile(99) << " max " << latency.max
+            << ", request bytes p50 " << entry.requestBytes.percentile(50)
+            << " max " << entry.requestBytes.max
+            << ", reply bytes p50 " << entry.replyBytes.percentile(50)
+            << " max " << entry.replyBytes.max << endl;
+    }
+    out << "Dropped recordings: " << droppedCount() << endl;
+}
+
+// ---------------------------------------------------------------------------
+
+TransactionStatsRecorder::TransactionStatsRecorder()
+    : mDropped(0)
+{
+    for (size_t i = 0; i < kSlotCount; i++) {
+        mSlots[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    Registry& r = registry();
+    AutoMutex _l(r.lock);
+    r.recorders.push_back(this);
+}
+
+TransactionStatsRecorder::~TransactionStatsRecorder()
+{
+    Registry& r = registry();
+    {
+        AutoMutex _l(r.lock);
+        // Keep what this thread recorded after it is gone.
+        std::vector<TransactionStats::Entry> entries;
+        collect(&entries);
+        for (const TransactionStats::Entry& entry : entries) {
+            mergeEntry(&r.retired, entry);
+        }
+        r.retiredDropped += mDropped.load(std::memory_order_relaxed);
+        r.recorders.erase(std::find(r.recorders.begin(), r.recorders.end(), this));
+    }
+
+    for (size_t i = 0; i < kSlotCount; i++) {
+        delete mSlots[i].load(std::memory_order_relaxed);
+    }
+}
+
+void TransactionStatsRecorder::record(TransactionStats::Side side, uintptr_t target,
+                                      uint32_t code, const Parcel& request,
+                                      uint64_t latencyNs, size_t replySize)
+{
+    record(findSlot(side, target, code, request), request.dataSize(), latencyNs, replySize);
+}
+
+void TransactionStatsRecorder::record(Slot* slot, size_t requestBytes, uint64_t latencyNs,
+                                      size_t replySize)
+{
+    if (slot == nullptr) {
+        const uint64_t dropped = mDropped.load(std::memory_order_relaxed);
+        if (dropped == 0) {
+            ALOGW("Transaction stats of thread %d are full; new methods are not recorded",
+                  gettid());
+        }
+        mDropped.store(dropped + 1, std::memory_order_relaxed);
+        return;
+    }
+    slot->latencyNs.add(latencyNs);
+    slot->requestBytes.add(requestBytes);
+    slot->replyBytes.add(replySize);
+}
+
+TransactionStatsRecorder::Slot* TransactionStatsRecorder::findSlot(
+        TransactionStats::Side side, uintptr_t target, uint32_t code, const Parcel& request)
+{
+    const char* descriptor;
+    size_t descriptorLen;
+    readDescriptor(request, &descriptor, &descriptorLen);
+
+    // Targets are only a hint: handles and objects get reused, so a slot is
+    // only taken if the interface token matches as well.
+    uint64_t hash = ((uint64_t)target * 0x9E3779B97F4A7C15ull) ^
+                    ((uint64_t)code * 0xC2B2AE3D27D4EB4Full) ^ (uint64_t)side;
+    size_t index = (size_t)(hash >> 32) % kSlotCount;
+
+    for (size_t probe = 0; probe < kSlotCount; probe++) {
+        Slot* slot = mSlots[index].load(std::memory_order_relaxed);
+        if (slot == nullptr) {
+            slot = new (std::nothrow) Slot();
+            if (slot == nullptr) return nullptr;
+
+            slot->side = side;
+            slot->target = target;
+            slot->code = code;
+            {
+                Registry& r = registry();
+                AutoMutex _l(r.lock);
+                const std::string& interned =
+                        *r.descriptors.emplace(descriptor, descriptorLen).first;
+                slot->descriptor = interned.c_str();
+                slot->descriptorLen = interned.size();
+            }
+            // Pairs with the acquire load in collect().
+            mSlots[index].store(slot, std::memory_order_release);
+            return slot;
+        }
+        if (slot->side == side && slot->target == target && slot->code == code &&
+            slot->descriptorLen == descriptorLen &&
+            memcmp(slot->descriptor, descriptor, descriptorLen) == 0) {
+            return slot;
+        }
+        index = (index + 1) % kSlotCount;
+    }
+    return nullptr;
+}
+
+void TransactionStatsRecorder::collect(std::vector<TransactionStats::Entry>* entries) const
+{
+    for (size_t i = 0; i < kSlotCount; i++) {
+        const Slot* slot = mSlots[i].load(std::memory_order_acquire);
+        if (slot == nullptr) continue;
+
+        TransactionStats::Entry entry;
+        entry.side = slot->side;
+        entry.descriptor.assign(slot->descriptor, slot->descriptorLen);
+        entry.code = slot->code;
+        slot->latencyNs.readInto(&entry.latencyNs);
+        slot->requestBytes.readInto(&entry.requestBytes);
+        slot->replyBytes.readInto(&entry.replyBytes);
+        entries->push_back(std::move(entry));
+    }
+}
+
+} // namespace hardware
+} // namespace android
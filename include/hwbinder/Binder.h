@@ -56,6 +56,10 @@ public:
 
     int                 getMinSchedulingPolicy();
     int                 getMinSchedulingPriority();
+    // Minimum policy and priority a thread runs at while handling a
+    // transaction on this node, raised by the receiving thread itself when
+    // the driver didn't. Not thread safe; call before the object is sent.
+    void                setMinSchedulerPolicy(int policy, int priority);
 
     bool                isRequestingSid();
 
@@ -38,6 +38,36 @@ public:
                                     uint32_t flags = 0,
                                     TransactCallback callback = nullptr);
 
+            // Reserves capacity in data for a call to code, sized after the
+            // last such call made from this thread, before it is written.
+            void        reserveData(uint32_t code, Parcel* data) const;
+
+    using AsyncCallback = std::function<void(status_t status, Parcel& reply)>;
+
+            // Queues a two-way call and returns without waiting for it. A
+            // binder thread can only wait for its own reply, so the call is
+            // made from one of a fixed set of process-wide dispatcher threads,
+            // which also run callback once the reply (or an error) arrives.
+            // data is copied before this returns, with its file descriptors
+            // duplicated, so the caller may destroy it and close them right
+            // away. Fails with BAD_VALUE for FLAG_ONEWAY calls, which never
+            // block to begin with.
+            status_t    transactAsync(uint32_t code,
+                                      const Parcel& data,
+                                      AsyncCallback callback,
+                                      uint32_t flags = 0);
+
+            // Upper bound on the dispatcher threads, which are started as
+            // calls are queued; calls beyond it wait for a free thread.
+            // Defaults to 4.
+    static  void        setAsyncDispatcherThreads(size_t maxThreads);
+
+            // Runs death recipients on up to maxThreads threads of their own,
+            // one task per recipient, rather than one after the other on the
+            // binder thread that got BR_DEAD_BINDER. Zero, the default, keeps
+            // delivering them inline.
+    static  void        setObituaryDispatchThreads(size_t maxThreads);
+
     virtual status_t    linkToDeath(const sp<DeathRecipient>& recipient,
                                     void* cookie = nullptr,
                                     uint32_t flags = 0);
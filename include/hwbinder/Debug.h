@@ -41,6 +41,9 @@ void printHexData(int32_t indent, const void *buf, size_t length,
 
 ssize_t getHWBinderKernelReferences(size_t count, uintptr_t* buf);
 
+// Prints ProcessState::getThreadPoolStats(), e.g. from a HAL's debug().
+void printThreadPoolStats(debugPrintFunc func = nullptr, void* cookie = nullptr);
+
 __END_DECLS
 
 // ---------------------------------------------------------------------------
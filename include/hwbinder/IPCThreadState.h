@@ -20,9 +20,13 @@
 #include <utils/Errors.h>
 #include <hwbinder/Parcel.h>
 #include <hwbinder/ProcessState.h>
+#include <hwbinder/TransactionStats.h>
 #include <utils/Vector.h>
 
+#include <atomic>
 #include <functional>
+#include <memory>
+#include <vector>
 
 #if defined(_WIN32)
 typedef  int  uid_t;
@@ -33,6 +37,8 @@ namespace android {
 
 namespace hardware {
 
+class TextOutput;
+
 class IPCThreadState
 {
 public:
@@ -61,9 +67,19 @@ public:
             // Restores PID/UID (not SID)
             void                restoreCallingIdentity(int64_t token);
 
-            int                 setupPolling(int* fd);
-            status_t            handlePolledCommands();
+            // readBufferSize, if larger than the default, sets how many bytes
+            // of driver commands a single read can return.
+            int                 setupPolling(int* fd, size_t readBufferSize = 0);
+            // Executes every command from the last read, then reads again for
+            // as long as the driver has more and fewer than maxReads reads
+            // were made. serviced, if not null, is set to the number of
+            // incoming transactions handled.
+            status_t            handlePolledCommands(size_t* serviced = nullptr,
+                                                     size_t maxReads = 1);
             void                flushCommands();
+            // Sends queued BC_FREE_BUFFERs to the driver now, along with the
+            // rest of the command buffer, unless a oneway batch is open.
+            void                flushFreedBuffers();
 
             void                joinThreadPool(bool isMain = true);
 
@@ -74,6 +90,37 @@ public:
                                          uint32_t code, const Parcel& data,
                                          Parcel* reply, uint32_t flags);
 
+            // Oneway batching. While a batch is open, oneway transactions made
+            // from this thread are queued instead of being sent one ioctl at a
+            // time; their parcels are copied, file descriptors included, so
+            // callers may reuse or destroy them, and close the descriptors
+            // they passed, right away. flushOnewayBatch() closes the batch
+            // and submits everything that was queued in a single BINDER_WRITE_READ,
+            // returning the first error reported for any of the transactions.
+            // Batches nest; only the outermost flush submits. A two-way call
+            // made while a batch is open submits the queued transactions first.
+            // Death notification requests and clears made while a batch is
+            // open are sent along with it too.
+            void                beginOnewayBatch();
+            status_t            flushOnewayBatch();
+
+            // Keeps a oneway batch open on the calling thread for its lifetime.
+            class BatchScope {
+            public:
+                BatchScope() : mState(IPCThreadState::self()) { mState->beginOnewayBatch(); }
+                ~BatchScope() { mState->flushOnewayBatch(); }
+            private:
+                BatchScope(const BatchScope&) = delete;
+                BatchScope& operator=(const BatchScope&) = delete;
+
+                IPCThreadState* const mState;
+            };
+
+            // Reserves capacity in data for a request to handle/code, sized
+            // after the last such request made from this thread.
+            void                reserveTransactionData(int32_t handle, uint32_t code,
+                                                       Parcel* data);
+
             void                incStrongHandle(int32_t handle, BpHwBinder *proxy);
             void                decStrongHandle(int32_t handle);
             void                incWeakHandle(int32_t handle, BpHwBinder *proxy);
@@ -84,6 +131,9 @@ public:
                                                             BpHwBinder* proxy);
             status_t            clearDeathNotification( int32_t handle,
                                                         BpHwBinder* proxy);
+            // Sends the death notification commands queued above, or leaves
+            // them for flushOnewayBatch() if a batch is open.
+            void                flushDeathNotifications();
 
     static  void                shutdown();
 
@@ -104,6 +154,21 @@ public:
             // threadpool.
             void addPostCommandTask(const std::function<void(void)>& task);
 
+            // Deferred command logging. While enabled, every thread copies the
+            // raw commands it exchanges with the driver, and the head of each
+            // transaction it sends, into a ring of ringSize bytes of its own;
+            // nothing is formatted until dumpCommandLogs(). Unlike
+            // IF_LOG_COMMANDS() this takes no lock on the calling path and is
+            // available in release builds. A ringSize of zero turns it off
+            // and keeps what was logged so far.
+    static  void                setCommandLogging(size_t ringSize);
+    static  bool                isCommandLogging() {
+                                    return sCommandLogSize.load(std::memory_order_relaxed) != 0;
+                                }
+            // Formats the logged commands of every thread, oldest first,
+            // including those of threads that have exited since.
+    static  void                dumpCommandLogs(TextOutput& out);
+
            private:
             IPCThreadState();
             ~IPCThreadState();
@@ -118,12 +183,69 @@ public:
                                                      uint32_t code,
                                                      const Parcel& data,
                                                      status_t* statusBuffer);
+            status_t            queueOnewayTransaction(int32_t handle, uint32_t code,
+                                                       const Parcel& data, uint32_t flags);
+            status_t            submitOnewayBatch();
             status_t            getAndExecuteCommand();
+            status_t            waitForWorkOrReap();
             status_t            executeCommand(int32_t command);
             void                processPendingDerefs();
             void                processPostWriteDerefs();
 
             void                clearCaller();
+            void                recordTransactionStats(TransactionStats::Side side,
+                                                       uintptr_t target, uint32_t code,
+                                                       const Parcel& request,
+                                                       int64_t startNs, size_t replySize);
+            // Created the first time it is needed; null if that fails.
+            TransactionStatsRecorder* statsRecorder();
+
+            // Reply bookkeeping of an incoming transaction, shared with the
+            // callback handed to BHwBinder::transact().
+            struct ReplyState {
+                Parcel*         reply;
+                uint32_t        flags;
+                bool            sent;
+                size_t          size;
+                size_t          objects;
+            };
+
+            // A BC_ACQUIRE, BC_RELEASE, BC_INCREFS or BC_DECREFS in mOut.
+            struct RefCommand {
+                size_t          offset;
+                int32_t         cmd;
+                int32_t         handle;
+            };
+
+            void                writeRefCommand(int32_t cmd, int32_t handle);
+            void                coalesceRefCommands();
+
+            // Shape of the last parcel seen for a (target, code) pair, used to
+            // size the next one up front. Direct-mapped; collisions just evict.
+            struct SizeHint {
+                uintptr_t       target;
+                uint32_t        code;
+                uint32_t        dataSize;
+                size_t          objectsCount;
+            };
+            static constexpr size_t kSizeHintCount = 64;
+
+    static  SizeHint&           sizeHintFor(SizeHint* table, uintptr_t target, uint32_t code);
+    static  void                recordSizeHint(SizeHint* table, uintptr_t target, uint32_t code,
+                                               size_t dataSize, size_t objectsCount);
+    static  void                applySizeHint(SizeHint* table, uintptr_t target, uint32_t code,
+                                              Parcel* parcel);
+
+            // Marks a flush of the queued frees as due, by the buffer free
+            // policy; flushPendingFrees() sends it once that is safe.
+            void                scheduleFreeFlush(size_t freedSize);
+            void                flushPendingFrees();
+
+            struct CommandLog;
+            void                logCommand(uint32_t kind, const void* data, size_t size,
+                                           int32_t handle = 0, uint32_t code = 0,
+                                           uint32_t flags = 0);
+    static  std::atomic<size_t> sCommandLogSize;
 
     static  void                threadDestructor(void *st);
     static  void                freeBuffer(Parcel* parcel,
@@ -136,21 +258,63 @@ public:
             Vector<RefBase::weakref_type*> mPendingWeakDerefs;
             Vector<RefBase*>    mPostWriteStrongDerefs;
             Vector<RefBase::weakref_type*> mPostWriteWeakDerefs;
+            // Refcount commands written since mOut was last submitted.
+            std::vector<RefCommand> mRefCommands;
             Parcel              mIn;
             Parcel              mOut;
             status_t            mLastError;
-            const void*         mServingStackPointer;
-            pid_t               mCallingPid;
-            const char*         mCallingSid;
-            uid_t               mCallingUid;
-            int32_t             mStrictModePolicy;
-            int32_t             mLastTransactionBinderFlags;
+            // Identity of the transaction being served, saved and restored
+            // as a whole around every incoming one.
+            struct CallingState {
+                const void*     servingStackPointer;
+                pid_t           pid;
+                const char*     sid;
+                uid_t           uid;
+                int32_t         strictModePolicy;
+                int32_t         lastTransactionBinderFlags;
+            };
+            CallingState        mCalling;
             bool                mIsLooper;
             bool mIsPollingThread;
+            // Incoming transactions handled so far; see handlePolledCommands().
+            size_t              mTransactionsServiced;
+            // BC_FREE_BUFFERs in mOut; see ProcessState::setBufferFreePolicy().
+            size_t              mQueuedFrees;
+            bool                mFreeFlushPending;
+            // Pool thread that may exit after the adaptive idle timeout.
+            bool                mIsReapable;
 
             std::vector<std::function<void(void)>> mPostCommandTasks;
 
             ProcessState::CallRestriction mCallRestriction;
+
+            // Oneway batching state; see beginOnewayBatch().
+            size_t              mOnewayBatchDepth;
+            status_t            mOnewayBatchError;
+            bool                mSubmittingOnewayBatch;
+            bool                mDeathNotificationsDeferred;
+            // Copies of the queued parcels, kept until the driver has consumed them.
+            std::vector<std::unique_ptr<Parcel>> mOnewayBatch;
+
+            SizeHint            mRequestSizeHints[kSizeHintCount];
+            SizeHint            mReplySizeHints[kSizeHintCount];
+
+            // Created the first time a transaction is recorded.
+            std::unique_ptr<TransactionStatsRecorder> mStatsRecorder;
+
+            // Pool profile of this looper, registered with mProcess while in
+            // joinThreadPool(), and the time of its last read that returned
+            // commands.
+            ProcessState::PoolThreadProfile mPoolProfile;
+            int64_t             mLastReadNs;
+
+            // Request and reply parcels of the outermost incoming transaction.
+            Parcel              mDispatchRequest;
+            Parcel              mDispatchReply;
+            bool                mDispatchParcelsInUse;
+
+            // Ring of this thread's commands; see setCommandLogging().
+            CommandLog*         mCommandLog;
 };
 
 } // namespace hardware
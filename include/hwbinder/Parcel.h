@@ -17,7 +17,14 @@
 #ifndef ANDROID_HARDWARE_PARCEL_H
 #define ANDROID_HARDWARE_PARCEL_H
 
+#include <stdint.h>
+#include <string.h>
+
+#include <map>
+#include <memory>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 #include <cutils/native_handle.h>
@@ -29,6 +36,7 @@
 
 struct binder_buffer_object;
 struct flat_binder_object;
+struct iovec;
 
 // ---------------------------------------------------------------------------
 namespace android {
@@ -49,6 +57,7 @@ class TextOutput;
 
 class Parcel {
     friend class IPCThreadState;
+    friend class TransactionRecorder;
 public:
 
                         Parcel();
@@ -63,9 +72,21 @@ public:
     status_t            setDataSize(size_t size);
     void                setDataPosition(size_t pos) const;
     status_t            setDataCapacity(size_t size);
+    // Grows data and object capacity to at least the given sizes in one
+    // step, so that a parcel of known shape is written without reallocating.
+    // Fails with INVALID_OPERATION on a parcel received from the driver.
+    status_t            reserve(size_t dataBytes, size_t objectsCount);
 
     status_t            setData(const uint8_t* buffer, size_t len);
 
+    // Replaces the contents of this parcel with a self-contained copy of
+    // another one: the flat data, the object offsets and the contents of
+    // every scatter-gather buffer it references, so that the copy can be
+    // sent after the original is gone. Binder objects are acquired again
+    // and file descriptors, including those in fd arrays, are duplicated
+    // and owned by the copy.
+    status_t            copyFrom(const Parcel& other);
+
     // Writes the RPC header.
     status_t            writeInterfaceToken(const char* interface);
 
@@ -73,8 +94,34 @@ public:
     // in the header matches the expected interface from the caller.
     bool                enforceInterface(const char* interface) const;
 
+    // An interface name laid out the way it goes on the wire: NUL-terminated
+    // and padded with zeros to a multiple of 4 bytes.
+    struct InterfaceToken {
+        const char*         name;
+        size_t              length;     // strlen(name)
+        size_t              padded;     // bytes written to the parcel
+    };
+
+    // Returns the token for an interface name, creating it on first use.
+    // Tokens live as long as the process, so callers keep the pointer
+    // (typically next to the descriptor) and pass it on every call.
+    static const InterfaceToken* internInterfaceToken(const char* interface);
+
+    // Same as the overloads taking a name, without measuring or comparing
+    // it character by character. The header on the wire is unchanged, so
+    // either side may use either form.
+    status_t            writeInterfaceToken(const InterfaceToken* token);
+    bool                enforceInterface(const InterfaceToken* token) const;
+
     void                freeData();
 
+    // For a parcel received from the driver: releases its buffer and tells
+    // the driver right away, rather than with the next command, so that the
+    // space can take another transaction. The contents are gone afterwards;
+    // copy out whatever is still needed first. Const so that a server can
+    // call it on the request handed to onTransact().
+    status_t            releaseKernelBufferNow() const;
+
 private:
     const binder_size_t* objects() const;
 
@@ -104,12 +151,49 @@ public:
     status_t            writeStrongBinder(const sp<IBinder>& val);
     status_t            writeBool(bool val);
 
+    // Arrays of scalars: a 32-bit element count, or -1 for a null array,
+    // followed by the elements, written with a single capacity check.
+    status_t            writeInt32Array(const int32_t* values, size_t count);
+    status_t            writeUint32Array(const uint32_t* values, size_t count);
+    status_t            writeInt64Array(const int64_t* values, size_t count);
+    status_t            writeUint64Array(const uint64_t* values, size_t count);
+    status_t            writeFloatArray(const float* values, size_t count);
+    status_t            writeDoubleArray(const double* values, size_t count);
+
     template<typename T>
     status_t            writeObject(const T& val);
 
+    // Writes a fixed-layout struct as one block, with a single capacity
+    // check. T must be trivially copyable and a multiple of 4 bytes long,
+    // so that it lands in the parcel exactly as sizeof(T) bytes; both are
+    // checked at compile time.
+    template<typename T>
+    status_t            writePod(const T& val);
+
+    // Writes each argument the way the matching writeInt32(), writeFloat(),
+    // writeBool() ... or writePod() would, one after the other, but with a
+    // single capacity check. Scalars shorter than 4 bytes are padded with
+    // zeros, as write() pads them.
+    template<typename... Ts>
+    status_t            writeFields(const Ts&... vals);
+
+    // An array of structs, laid out like the scalar arrays below.
+    template<typename T>
+    status_t            writePodArray(const T* values, size_t count);
+
     status_t            writeBuffer(const void *buffer, size_t length, size_t *handle);
     status_t            writeEmbeddedBuffer(const void *buffer, size_t length, size_t *handle,
                             size_t parent_buffer_handle, size_t parent_offset);
+    // Writes each segment as its own top-level buffer object referencing the
+    // caller's memory, growing the parcel at most once for all of them. The
+    // non-null segments get consecutive handles starting at *firstHandle:
+    // like writeBuffer(), a null segment takes no handle, so the k-th
+    // non-null one gets *firstHandle + k. The parcel holds on to guard until
+    // its data is freed, so the memory behind the segments may be tied to it
+    // and outlive the caller.
+    status_t            writeBuffers(const struct iovec* segments, size_t count,
+                                     const std::shared_ptr<const void>& guard,
+                                     size_t* firstHandle);
 public:
     status_t            writeEmbeddedNativeHandle(const native_handle_t *handle,
                             size_t parent_buffer_handle, size_t parent_offset);
@@ -146,6 +230,22 @@ public:
     status_t            readString16(String16* pArg) const;
     status_t            readString16(std::unique_ptr<String16>* pArg) const;
     const char16_t*     readString16Inplace(size_t* outLen) const;
+
+    // Arrays written by the calls above. The Inplace variants point into the
+    // parcel, valid for as long as its data, and return null for a null
+    // array or on error; parcel data is only 4-byte aligned, so there are
+    // none for 64-bit elements. The others copy, and return UNEXPECTED_NULL
+    // for a null array.
+    const int32_t*      readInt32ArrayInplace(size_t* outCount) const;
+    const uint32_t*     readUint32ArrayInplace(size_t* outCount) const;
+    const float*        readFloatArrayInplace(size_t* outCount) const;
+    status_t            readInt32Array(std::vector<int32_t>* values) const;
+    status_t            readUint32Array(std::vector<uint32_t>* values) const;
+    status_t            readInt64Array(std::vector<int64_t>* values) const;
+    status_t            readUint64Array(std::vector<uint64_t>* values) const;
+    status_t            readFloatArray(std::vector<float>* values) const;
+    status_t            readDoubleArray(std::vector<double>* values) const;
+
     sp<IBinder>         readStrongBinder() const;
     status_t            readStrongBinder(sp<IBinder>* val) const;
     status_t            readNullableStrongBinder(sp<IBinder>* val) const;
@@ -153,6 +253,47 @@ public:
     template<typename T>
     const T*            readObject(size_t *objects_offset = nullptr) const;
 
+    // Counterparts of writePod() and writeFields(). Nothing is read unless
+    // all of it is available.
+    template<typename T>
+    status_t            readPod(T* val) const;
+    template<typename... Ts>
+    status_t            readFields(Ts*... vals) const;
+
+    // A typed window into data the parcel refers to: its own data, or the
+    // memory of a buffer object. For a received parcel that is the driver's
+    // mapping, so a view is only valid until the parcel is freed, rewritten
+    // or released with releaseKernelBufferNow().
+    template<typename T>
+    struct InplaceView {
+        const T*            data = nullptr;
+        size_t              size = 0;
+
+        bool                empty() const { return size == 0; }
+        const T*            begin() const { return data; }
+        const T*            end() const { return data + size; }
+        const T&            operator[](size_t i) const { return data[i]; }
+    };
+
+    // Views of what writePod() and writePodArray() wrote, without copying.
+    // readPodInplace() returns null if not enough data is left. Parcel data
+    // is only 4-byte aligned, so T may not need more; use readPod() then.
+    template<typename T>
+    const T*            readPodInplace() const;
+    template<typename T>
+    status_t            readPodArrayInplace(InplaceView<T>* view) const;
+
+    // Typed readBuffer() and readEmbeddedBuffer() for a buffer of count
+    // elements. Fail with BAD_VALUE if the buffer is not aligned for T.
+    template<typename T>
+    status_t            readBufferInplace(size_t count, size_t* buffer_handle,
+                                          InplaceView<T>* view) const;
+    template<typename T>
+    status_t            readEmbeddedBufferInplace(size_t count, size_t* buffer_handle,
+                                                  size_t parent_buffer_handle,
+                                                  size_t parent_offset,
+                                                  InplaceView<T>* view) const;
+
     status_t            readBuffer(size_t buffer_size, size_t *buffer_handle,
                                    const void **buffer_out) const;
     status_t            readNullableBuffer(size_t buffer_size, size_t *buffer_handle,
@@ -179,6 +320,10 @@ public:
     // Debugging: get metrics on current allocations.
     static size_t       getGlobalAllocSize();
     static size_t       getGlobalAllocCount();
+    // Number of data/objects buffer allocations served from, or missing,
+    // the per-thread buffer cache.
+    static size_t       getGlobalPoolHitCount();
+    static size_t       getGlobalPoolMissCount();
 
 private:
     // Below is a cache that records some information about all actual buffers
@@ -191,10 +336,29 @@ private:
     // value of mObjectSize when mBufCache is last updated.
     mutable size_t                  mBufCachePos;
     mutable std::vector<BufferInfo> mBufCache;
-    // clear mBufCachePos and mBufCache.
+    // Once the parcel has enough buffers, mBufCache positions indexed by
+    // buffer start: sorted for findBuffer() (non-empty buffers only, valid
+    // while mBufOverlap is false), and hashed for quickFindBuffer().
+    mutable bool                    mBufIndexed;
+    mutable bool                    mBufOverlap;
+    mutable std::map<binder_uintptr_t, size_t> mBufStartIndex;
+    mutable std::unordered_map<binder_uintptr_t, size_t> mBufStartHash;
+    // clear mBufCachePos, mBufCache and the indexes.
     void                clearCache() const;
     // update mBufCache for all objects between mBufCachePos and mObjectsSize
     void                updateCache() const;
+    // add mBufCache[cachePos] to the indexes
+    void                indexBuffer(size_t cachePos) const;
+
+    // For parcels received from the driver, whose object offsets have been
+    // checked to be ascending: an open-addressing table from data offset to
+    // mObjects index (plus one; zero is empty), built the first time a
+    // readObject() misses its hint.
+    mutable std::vector<uint32_t>   mObjectIndex;
+    bool                            mObjectsValidated;
+    void                buildObjectIndex() const;
+    ssize_t             findIndexedObject(size_t dataPos) const;
+    void                clearObjectIndex();
 
     bool                verifyBufferObject(const binder_buffer_object *buffer_obj,
                                            size_t size, uint32_t flags, size_t parent,
@@ -261,6 +425,15 @@ private:
     void                releaseObjects();
     void                acquireObjects();
     status_t            growData(size_t len);
+    status_t            growObjects(size_t count);
+    uint8_t*            allocDataStorage(size_t capacity);
+    uint8_t*            reallocDataStorage(uint8_t* data, size_t oldCapacity,
+                                           size_t newCapacity);
+    void                freeDataStorage(uint8_t* data, size_t capacity);
+    binder_size_t*      allocObjectsStorage(size_t capacity);
+    binder_size_t*      reallocObjectsStorage(binder_size_t* objects, size_t oldCapacity,
+                                              size_t newCapacity);
+    void                freeObjectsStorage(binder_size_t* objects, size_t capacity);
     status_t            restartWrite(size_t desired);
     status_t            continueWrite(size_t desired);
     status_t            writePointer(uintptr_t val);
@@ -278,6 +451,24 @@ private:
     template<class T>
     status_t            writeAligned(T val);
 
+    template<class T>
+    status_t            writeArray(const T* values, size_t count);
+    template<class T>
+    status_t            readArrayData(const void** data, size_t* count) const;
+    template<class T>
+    status_t            readArrayInplace(const T** values, size_t* count) const;
+    template<class T>
+    status_t            readArray(std::vector<T>* values) const;
+
+    // Bytes a field takes in the parcel, for writeFields() and readFields().
+    template<typename T>
+    static constexpr size_t podSize();
+    template<typename T>
+    static void         copyPodOut(uint8_t** out, const T& val);
+    template<typename T>
+    static void         copyPodIn(const uint8_t** in, T* val);
+    static void         copyPodIn(const uint8_t** in, bool* val);
+
     status_t            mError;
     uint8_t*            mData;
     size_t              mDataSize;
@@ -296,9 +487,215 @@ private:
 
     release_func        mOwner;
     void*               mOwnerCookie;
+
+    // Keep caller memory referenced by writeBuffers() alive.
+    std::vector<std::shared_ptr<const void>> mBufferGuards;
+
+    // Descriptors in fd arrays duplicated by copyFrom(), closed with the
+    // parcel; single descriptors are owned through their cookie instead.
+    std::vector<int>    mOwnedFds;
+
+    // Inline storage for small parcels, so that the common case needs no
+    // allocation and the payload shares cache lines with the header.
+    static constexpr size_t kInlineDataSize = 256;
+    static constexpr size_t kInlineObjectsCount = 4;
+    alignas(8) uint8_t  mInlineData[kInlineDataSize];
+    binder_size_t       mInlineObjects[kInlineObjectsCount];
 };
 // ---------------------------------------------------------------------------
 
+template<typename T>
+constexpr size_t Parcel::podSize()
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Parcel fields must be trivially copyable");
+    static_assert(std::is_arithmetic<T>::value || sizeof(T) % 4 == 0,
+                  "Parcel structs must be a multiple of 4 bytes long");
+    return (sizeof(T) + 3) & ~static_cast<size_t>(3);
+}
+
+template<typename T>
+void Parcel::copyPodOut(uint8_t** out, const T& val)
+{
+    memcpy(*out, &val, sizeof(T));
+    if (podSize<T>() != sizeof(T)) {
+        memset(*out + sizeof(T), 0, podSize<T>() - sizeof(T));
+    }
+    *out += podSize<T>();
+}
+
+template<typename T>
+void Parcel::copyPodIn(const uint8_t** in, T* val)
+{
+    memcpy(val, *in, sizeof(T));
+    *in += podSize<T>();
+}
+
+inline void Parcel::copyPodIn(const uint8_t** in, bool* val)
+{
+    // Any nonzero byte is true, as in readBool().
+    *val = **in != 0;
+    *in += podSize<bool>();
+}
+
+template<typename T>
+status_t Parcel::writePod(const T& val)
+{
+    static_assert(!std::is_arithmetic<T>::value, "use writeFields() for scalars");
+    return writeFields(val);
+}
+
+template<typename... Ts>
+status_t Parcel::writeFields(const Ts&... vals)
+{
+    constexpr size_t size = (podSize<Ts>() + ... + 0);
+    uint8_t* out = static_cast<uint8_t*>(writeInplace(size));
+    if (out == nullptr) return NO_MEMORY;
+    (copyPodOut(&out, vals), ...);
+    return NO_ERROR;
+}
+
+template<typename T>
+status_t Parcel::readPod(T* val) const
+{
+    static_assert(!std::is_arithmetic<T>::value, "use readFields() for scalars");
+    return readFields(val);
+}
+
+template<typename... Ts>
+status_t Parcel::readFields(Ts*... vals) const
+{
+    constexpr size_t size = (podSize<Ts>() + ... + 0);
+    const uint8_t* in = static_cast<const uint8_t*>(readInplace(size));
+    if (in == nullptr) return NOT_ENOUGH_DATA;
+    (copyPodIn(&in, vals), ...);
+    return NO_ERROR;
+}
+
+template<typename T>
+status_t Parcel::writePodArray(const T* values, size_t count)
+{
+    static_assert(!std::is_arithmetic<T>::value, "use the typed array writes for scalars");
+    return writeArray(values, count);
+}
+
+template<class T>
+status_t Parcel::writeArray(const T* values, size_t count)
+{
+    static_assert(podSize<T>() == sizeof(T), "array elements must be a multiple of 4 bytes");
+    if (values == nullptr) {
+        return count == 0 ? writeInt32(-1) : BAD_VALUE;
+    }
+    if (count > (INT32_MAX - sizeof(int32_t)) / sizeof(T)) return BAD_VALUE;
+
+    const size_t bytes = count * sizeof(T);
+    uint8_t* data = static_cast<uint8_t*>(writeInplace(sizeof(int32_t) + bytes));
+    if (data == nullptr) return NO_MEMORY;
+    *reinterpret_cast<int32_t*>(data) = count;
+    memcpy(data + sizeof(int32_t), values, bytes);
+    return NO_ERROR;
+}
+
+template<class T>
+status_t Parcel::readArrayData(const void** data, size_t* count) const
+{
+    static_assert(podSize<T>() == sizeof(T), "array elements must be a multiple of 4 bytes");
+    *data = nullptr;
+    *count = 0;
+    int32_t size;
+    status_t err = readInt32(&size);
+    if (err != NO_ERROR) return err;
+    if (size == -1) return UNEXPECTED_NULL;
+    if (size < 0 || static_cast<size_t>(size) > INT32_MAX / sizeof(T)) return BAD_VALUE;
+
+    *data = readInplace(size * sizeof(T));
+    if (*data == nullptr) return NOT_ENOUGH_DATA;
+    *count = size;
+    return NO_ERROR;
+}
+
+template<class T>
+status_t Parcel::readArrayInplace(const T** values, size_t* count) const
+{
+    static_assert(alignof(T) <= 4, "parcel data is only 4-byte aligned; copy with readArray()");
+    const void* data;
+    status_t err = readArrayData<T>(&data, count);
+    *values = reinterpret_cast<const T*>(data);
+    return err;
+}
+
+template<class T>
+status_t Parcel::readArray(std::vector<T>* values) const
+{
+    const void* data;
+    size_t count;
+    status_t err = readArrayData<T>(&data, &count);
+    if (err == NO_ERROR) {
+        // Copied bytewise; the elements may not be aligned for T.
+        values->resize(count);
+        if (count > 0) memcpy(values->data(), data, count * sizeof(T));
+    } else {
+        values->clear();
+    }
+    return err;
+}
+
+template<typename T>
+const T* Parcel::readPodInplace() const
+{
+    static_assert(!std::is_arithmetic<T>::value, "use readFields() for scalars");
+    static_assert(alignof(T) <= 4, "parcel data is only 4-byte aligned; copy with readPod()");
+    return reinterpret_cast<const T*>(readInplace(podSize<T>()));
+}
+
+template<typename T>
+status_t Parcel::readPodArrayInplace(InplaceView<T>* view) const
+{
+    return readArrayInplace(&view->data, &view->size);
+}
+
+template<typename T>
+status_t Parcel::readBufferInplace(size_t count, size_t* buffer_handle,
+                                   InplaceView<T>* view) const
+{
+    static_assert(std::is_trivially_copyable<T>::value, "buffers hold plain data");
+    *view = InplaceView<T>();
+    if (count > SIZE_MAX / sizeof(T)) return BAD_VALUE;
+    const void* data;
+    status_t err = readBuffer(count * sizeof(T), buffer_handle, &data);
+    if (err == NO_ERROR && reinterpret_cast<uintptr_t>(data) % alignof(T) != 0) {
+        err = BAD_VALUE;
+    }
+    if (err == NO_ERROR) {
+        view->data = static_cast<const T*>(data);
+        view->size = count;
+    }
+    return err;
+}
+
+template<typename T>
+status_t Parcel::readEmbeddedBufferInplace(size_t count, size_t* buffer_handle,
+                                           size_t parent_buffer_handle, size_t parent_offset,
+                                           InplaceView<T>* view) const
+{
+    static_assert(std::is_trivially_copyable<T>::value, "buffers hold plain data");
+    *view = InplaceView<T>();
+    if (count > SIZE_MAX / sizeof(T)) return BAD_VALUE;
+    const void* data;
+    status_t err = readEmbeddedBuffer(count * sizeof(T), buffer_handle, parent_buffer_handle,
+                                      parent_offset, &data);
+    if (err == NO_ERROR && reinterpret_cast<uintptr_t>(data) % alignof(T) != 0) {
+        err = BAD_VALUE;
+    }
+    if (err == NO_ERROR) {
+        view->data = static_cast<const T*>(data);
+        view->size = count;
+    }
+    return err;
+}
+
+// ---------------------------------------------------------------------------
+
 inline TextOutput& operator<<(TextOutput& to, const Parcel& parcel)
 {
     parcel.print(to);
@@ -25,12 +25,19 @@
 #include <utils/threads.h>
 
 #include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <memory>
+#include <set>
+#include <vector>
 
 // ---------------------------------------------------------------------------
 namespace android {
 namespace hardware {
 
 class IPCThreadState;
+class PoolThread;
 
 class ProcessState : public virtual RefBase
 {
@@ -40,6 +47,10 @@ public:
     // Note: don't call self() or selfOrNull() before initWithMmapSize()
     // with '0' as an argument, this is the same as selfOrNull
     static  sp<ProcessState>    initWithMmapSize(size_t mmapSize); // size in bytes
+    // Size self() maps: ro.hwbinder.mmap_size.<program name> if set, else
+    // ro.hwbinder.mmap_size, else 1MB minus two pages. Clamped to what the
+    // driver accepts.
+    static  size_t              defaultMmapSize();
 
             void                setContextObject(const sp<IBinder>& object);
             sp<IBinder>         getContextObject(const sp<IBinder>& caller);
@@ -68,6 +79,20 @@ public:
 
             status_t            setThreadPoolConfiguration(size_t maxThreads, bool callerJoinsPool);
             size_t              getMaxThreads();
+            // Pins threads spawned for the pool from now on to the given CPUs.
+            status_t            setThreadPoolAffinity(const cpu_set_t& cpus);
+            // Scheduling policy and priority (nice value for SCHED_NORMAL, RT
+            // priority otherwise) that pool threads spawned from now on start
+            // at. The driver may change it while a thread handles a
+            // transaction; see BHwBinder::setMinSchedulerPolicy().
+            status_t            setThreadPoolSchedPolicy(int policy, int priority);
+            // Lets the pool size itself between minThreads and maxThreads
+            // instead of having the kernel request threads: a new thread is
+            // spawned whenever the last idle one picks up work, and threads
+            // above minThreads exit after idleTimeoutMs without work. Must be
+            // called before startThreadPool(); minThreads must be at least 1.
+            status_t            setThreadPoolAdaptive(size_t minThreads, size_t maxThreads,
+                                                      uint32_t idleTimeoutMs);
             void                giveThreadPoolName();
 
             ssize_t             getKernelReferences(size_t count, uintptr_t* buf);
@@ -79,6 +104,80 @@ public:
             ssize_t             getStrongRefCountForNodeByHandle(int32_t handle);
             size_t              getMmapSize();
 
+            // Use of the receive mapping. The driver does not report it, so
+            // buffer sizes are estimated from the received data, offsets and
+            // scatter-gather buffers, and may be off by alignment padding.
+            struct MmapUsage {
+                size_t          mmapSize;
+                size_t          bytesInUse;
+                size_t          highWaterBytes;
+                // Received buffers not yet released with BC_FREE_BUFFER.
+                size_t          pendingBuffers;
+                // Largest such buffer; only tracked for buffers of at least
+                // kLargeBufferBytes, zero if there is none.
+                size_t          largestPendingBytes;
+                // Outgoing calls that failed with BR_FAILED_REPLY, which is
+                // also what a target out of buffer space returns.
+                uint64_t        failedTransactions;
+            };
+    static  constexpr size_t    kLargeBufferBytes = 4096;
+            MmapUsage           getMmapUsage();
+
+            // BC_FREE_BUFFER normally waits in the command buffer for the
+            // next driver call. With a policy set, it is sent as soon as the
+            // command or call being handled completes for buffers of at
+            // least immediateBytes, and whenever a thread has maxBatched
+            // frees queued. Zero disables either rule.
+            void                setBufferFreePolicy(size_t immediateBytes, size_t maxBatched);
+
+            struct BufferFreeStats {
+                uint64_t        frees;
+                // Flushes caused by setBufferFreePolicy() thresholds.
+                uint64_t        immediateFlushes;
+                uint64_t        batchFlushes;
+                // Parcel::releaseKernelBufferNow() calls.
+                uint64_t        earlyReleases;
+            };
+            BufferFreeStats     getBufferFreeStats();
+
+            // Profiling of the pool threads, off by default since it reads
+            // the clock around every command. Enabling it starts a new
+            // profile; starvation is tracked either way.
+            void                setThreadPoolProfiling(bool enabled);
+
+            struct PoolThreadStats {
+                pid_t           tid;
+                uint64_t        busyNs;     // executing commands
+                uint64_t        idleNs;     // waiting in the driver for work
+                uint64_t        commands;
+            };
+
+            struct ThreadPoolStats {
+                size_t          maxThreads;
+                size_t          executingThreads;
+                size_t          peakExecutingThreads;
+                // Length of the profile, and the number of executing threads
+                // averaged over it.
+                uint64_t        profileNs;
+                double          averageExecutingThreads;
+                // Totals over all pool threads, including those that left.
+                uint64_t        busyNs;
+                uint64_t        idleNs;
+                uint64_t        commands;
+                // Time from the read that returned a command to the start of
+                // executeCommand(). Time queued inside the driver before that
+                // read is not visible to user space.
+                uint64_t        queueingNs;
+                uint64_t        maxQueueingNs;
+                // Periods with every thread of the pool busy.
+                uint64_t        starvationCount;
+                uint64_t        starvationMs;
+                uint64_t        longestStarvationMs;
+                // Threads currently in the pool.
+                std::vector<PoolThreadStats> threads;
+            };
+            ThreadPoolStats     getThreadPoolStats();
+
             enum class CallRestriction {
                 // all calls okay
                 NONE,
@@ -95,19 +194,70 @@ private:
     static  sp<ProcessState>    init(size_t mmapSize, bool requireMmapSize);
 
     friend class IPCThreadState;
+    friend class Parcel;
+    friend class PoolThread;
             explicit            ProcessState(size_t mmapSize);
                                 ~ProcessState();
 
                                 ProcessState(const ProcessState& o);
             ProcessState&       operator=(const ProcessState& o);
             String8             makeBinderThreadName();
+            // Applies the pool affinity and scheduling to the calling thread.
+            void                configurePooledThread();
+
+            void                mmapBufferReceived(size_t size);
+            void                mmapBufferFreed(size_t size);
+
+            // Pool profile of one looper thread, which is the only writer.
+            struct PoolThreadProfile {
+                pid_t           tid;
+                std::atomic<uint64_t> busyNs;
+                std::atomic<uint64_t> idleNs;
+                std::atomic<uint64_t> commands;
+            };
 
+            // Profile bookkeeping; these take or expect mThreadCountLock.
+            void                poolThreadJoined(PoolThreadProfile* profile);
+            void                poolThreadLeft(PoolThreadProfile* profile);
+            void                poolOccupancyChangingLocked(int64_t nowNs);
+            void                poolCommandStartingLocked(int64_t queueingNs);
+            void                poolStarvationEndedLocked(int64_t starvationMs);
+
+            // Adaptive pool bookkeeping; all of these take mThreadCountLock.
+            void                pooledThreadStarted();
+            void                adaptiveLooperJoined();
+            void                adaptiveLooperLeft();
+            bool                adaptiveShouldSpawnLocked();
+            bool                tryReapIdleLooper();
+
+            // Existing proxies are looked up without taking any lock: readers
+            // announce themselves through 'readers' before loading 'binder',
+            // and expungeHandle() waits for them to drain after clearing it.
             struct handle_entry {
-                IBinder* binder;
-                RefBase::weakref_type* refs;
+                std::atomic<IBinder*>   binder;
+                std::atomic<uint32_t>   readers;
+            };
+
+            // The handle table is a directory of lazily allocated chunks, so
+            // entries never move once published. The directory doubles when
+            // a handle past its end is needed; the ones it replaces are kept
+            // until destruction since readers may still be using them.
+            static constexpr size_t kHandleChunkSize = 256;
+            static constexpr size_t kInitialHandleChunkCount = 16;
+
+            struct handle_directory {
+                explicit                handle_directory(size_t chunkCount);
+
+                const size_t            count;
+                std::unique_ptr<std::atomic<handle_entry*>[]>
+                                        chunks;
+                std::unique_ptr<handle_directory>
+                                        previous;
             };
 
+            handle_entry*       lookupHandle(int32_t handle);
             handle_entry*       lookupHandleLocked(int32_t handle);
+            IBinder*            acquireWeakProxy(handle_entry* e);
 
             int                 mDriverFD;
             void*               mVMStart;
@@ -120,11 +270,38 @@ private:
             size_t              mMaxThreads;
             // Time when thread pool was emptied
             int64_t             mStarvationStartTimeMs;
+            uint64_t            mStarvationCount;
+            uint64_t            mStarvationTotalMs;
+            uint64_t            mLongestStarvationMs;
+            size_t              mPeakExecutingThreads;
+            // Pool profile; see setThreadPoolProfiling(). The occupancy
+            // integral is in thread-nanoseconds up to mOccupancyLastNs.
+            std::atomic<bool>   mPoolProfiling;
+            int64_t             mProfileStartNs;
+            int64_t             mOccupancyLastNs;
+            double              mOccupancyIntegral;
+            uint64_t            mQueueingNs;
+            uint64_t            mMaxQueueingNs;
+            std::vector<PoolThreadProfile*> mPoolThreadProfiles;
+            uint64_t            mExitedBusyNs;
+            uint64_t            mExitedIdleNs;
+            uint64_t            mExitedCommands;
+            // Adaptive pool configuration, fixed once the pool has started.
+            bool                mAdaptivePool;
+            size_t              mMinThreads;
+            uint32_t            mIdleTimeoutMs;
+            // Threads currently in joinThreadPool(), and threads spawned but
+            // not yet running, while the pool is adaptive.
+            size_t              mLooperCount;
+            size_t              mPendingSpawnCount;
+
+            // Serializes creation and expunging of proxies in the handle table.
+            Mutex               mHandleLock;
+            std::atomic<handle_directory*>
+                                mHandleDirectory;
 
     mutable Mutex               mLock;  // protects everything below.
 
-            Vector<handle_entry>mHandleToObject;
-
             bool                mManagesContexts;
             context_check_func  mBinderContextCheckFunc;
             void*               mBinderContextUserData;
@@ -134,11 +311,30 @@ private:
 
 
             String8             mRootDir;
+            bool                mPoolAffinitySet;
+            cpu_set_t           mPoolAffinity;
+            bool                mPoolSchedSet;
+            int                 mPoolSchedPolicy;
+            int                 mPoolSchedPriority;
             bool                mThreadPoolStarted;
             bool                mSpawnThreadOnStart;
     volatile int32_t            mThreadPoolSeq;
             const size_t        mMmapSize;
 
+            std::atomic<size_t> mMmapBytesInUse;
+            std::atomic<size_t> mMmapHighWater;
+            std::atomic<size_t> mMmapPendingBuffers;
+            std::atomic<uint64_t> mFailedTransactions;
+            Mutex               mLargeBufferLock;
+            std::multiset<size_t> mLargeBuffers;
+
+            std::atomic<size_t> mImmediateFreeBytes;
+            std::atomic<size_t> mMaxBatchedFrees;
+            std::atomic<uint64_t> mFrees;
+            std::atomic<uint64_t> mImmediateFreeFlushes;
+            std::atomic<uint64_t> mBatchedFreeFlushes;
+            std::atomic<uint64_t> mEarlyReleases;
+
             CallRestriction     mCallRestriction;
 };
 
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_TRANSACTION_RECORDER_H
+#define ANDROID_HARDWARE_TRANSACTION_RECORDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+#include <utils/Errors.h>
+
+// ---------------------------------------------------------------------------
+namespace android {
+namespace hardware {
+
+class Parcel;
+
+// Binary capture of transactions, recorded by IPCThreadState for outgoing
+// calls and for incoming BR_TRANSACTIONs into a ring buffer backed by a
+// memory-mapped file. Each record holds the flat data, the object offsets
+// and the contents of every scatter-gather buffer, which is enough for
+// vts/performance/Replay.cpp to send the call again. Once the ring is full
+// the oldest records are overwritten.
+class TransactionRecorder
+{
+public:
+    enum Direction : uint8_t {
+        OUTGOING,   // target is the handle called
+        INCOMING,   // target is the cookie of the local node called
+    };
+
+    static constexpr uint32_t kFileMagic = 0x52544248;     // "HBTR"
+    static constexpr uint32_t kFileVersion = 1;
+
+    // The file starts with a FileHeader; the ring follows at ringOffset.
+    struct FileHeader {
+        uint32_t            magic;
+        uint32_t            version;
+        uint64_t            ringOffset;
+        uint64_t            ringSize;
+        // Bytes reserved so far; the ring holds the last ringSize of them.
+        std::atomic<uint64_t> writePos;
+        // Records that did not fit in a quarter of the ring.
+        std::atomic<uint64_t> dropped;
+        int32_t             pid;
+        uint32_t            reserved;
+    };
+
+    // Records are 8-byte aligned and may wrap around the end of the ring.
+    // A RecordHeader is followed by dataSize bytes of data and objectsCount
+    // offsets, and then the contents of each BINDER_TYPE_PTR object in
+    // order; each of the three is padded to 8 bytes.
+    struct RecordHeader {
+        // Ring position of the record, stored last: a reader takes a header
+        // whose position matches where it was found as complete.
+        uint64_t            position;
+        uint32_t            size;
+        uint8_t             direction;
+        uint8_t             reserved[3];
+        uint64_t            target;
+        uint32_t            code;
+        uint32_t            flags;
+        int32_t             status;
+        int32_t             tid;
+        uint64_t            startNs;
+        uint64_t            durationNs;
+        uint32_t            dataSize;
+        uint32_t            objectsCount;
+        uint32_t            buffersSize;
+        uint32_t            reserved2;
+    };
+
+    struct Record {
+        RecordHeader        header;
+        std::vector<uint8_t> data;
+        std::vector<uint64_t> objects;
+        // Buffer contents, in the order of the BINDER_TYPE_PTR objects.
+        std::vector<std::vector<uint8_t>> buffers;
+    };
+
+    // Creates (or truncates) path and records into it from now on. The ring
+    // is rounded up to whole pages.
+    static status_t         start(const char* path, size_t ringSize);
+    // Stops recording after in-flight records are complete and syncs the
+    // file.
+    static void             stop();
+    static bool             isRecording() {
+                                return sRecording.load(std::memory_order_relaxed);
+                            }
+
+    static void             record(Direction direction, uint64_t target, uint32_t code,
+                                   uint32_t flags, const Parcel& data,
+                                   int64_t startNs, int64_t durationNs, status_t status);
+    // Copies the flat data, object offsets and buffer contents of an
+    // incoming request from the driver's buffer, which the server may hand
+    // back before the call completes; record it once it has.
+    static void             capture(uintptr_t data, size_t dataSize, uintptr_t objects,
+                                    size_t objectsCount, Record* request);
+    static void             record(Direction direction, uint64_t target, uint32_t code,
+                                   uint32_t flags, const Record& request,
+                                   int64_t startNs, int64_t durationNs, status_t status);
+
+    // Reads back the complete records of a capture, oldest first.
+    static status_t         read(const char* path, std::vector<Record>* records);
+
+private:
+    // Writes one record into the ring. The contents of the BINDER_TYPE_PTR
+    // objects are taken from buffers if it is set, or else read in place.
+    template <typename Offset>
+    static void             append(Direction direction, uint64_t target, uint32_t code,
+                                   uint32_t flags, const uint8_t* data, size_t dataSize,
+                                   const Offset* objects, size_t objectsCount,
+                                   const std::vector<std::vector<uint8_t>>* buffers,
+                                   int64_t startNs, int64_t durationNs, status_t status);
+
+    static std::atomic<bool> sRecording;
+};
+
+} // namespace hardware
+} // namespace android
+
+// ---------------------------------------------------------------------------
+
+#endif // ANDROID_HARDWARE_TRANSACTION_RECORDER_H
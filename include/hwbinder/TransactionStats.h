@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ANDROID_HARDWARE_TRANSACTION_STATS_H
+#define ANDROID_HARDWARE_TRANSACTION_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+// ---------------------------------------------------------------------------
+namespace android {
+namespace hardware {
+
+class Parcel;
+class TextOutput;
+class TransactionStatsRecorder;
+
+// Per-(interface, code) transaction statistics, recorded by IPCThreadState
+// for outgoing calls and for incoming BR_TRANSACTIONs. Recording is off by
+// default; once enabled, every thread writes into its own histograms without
+// taking any lock, and snapshot() merges them on demand.
+class TransactionStats
+{
+public:
+    // Log-linear buckets: four per power of two, which bounds the error of
+    // any percentile to 25%. Values past the last bucket are clamped into it.
+    static constexpr size_t kSubBucketBits = 2;
+    static constexpr size_t kBucketCount = 156;
+
+    struct Histogram {
+        uint64_t            count;
+        uint64_t            sum;
+        uint64_t            max;
+        uint64_t            buckets[kBucketCount];
+
+                            Histogram();
+
+        void                add(uint64_t value);
+        void                merge(const Histogram& other);
+        // Lower bound of the bucket containing the given percentile (0-100).
+        uint64_t            percentile(double p) const;
+
+        static size_t       bucketOf(uint64_t value);
+        static uint64_t     bucketLowerBound(size_t bucket);
+    };
+
+    enum Side {
+        CLIENT,     // round trip of an outgoing transact()
+        SERVER,     // time spent handling an incoming transaction
+    };
+
+    struct Entry {
+        Side                side;
+        std::string         descriptor;
+        uint32_t            code;
+        Histogram           latencyNs;
+        Histogram           requestBytes;
+        Histogram           replyBytes;
+    };
+
+    static void             setEnabled(bool enabled);
+    static bool             isEnabled() {
+                                return sEnabled.load(std::memory_order_relaxed);
+                            }
+
+    // Merges the statistics of all threads, including those that have exited,
+    // into one entry per (side, descriptor, code). Counters of live threads
+    // are read while they may be updated, so an entry can be off by the
+    // transactions in flight.
+    static std::vector<Entry> snapshot();
+
+    // Number of recordings dropped because a thread ran out of slots.
+    static uint64_t         droppedCount();
+
+    // Formats snapshot(), with the percentiles of each entry, followed by
+    // droppedCount().
+    static void             dump(TextOutput& out);
+
+private:
+    friend class TransactionStatsRecorder;
+
+    static std::atomic<bool> sEnabled;
+};
+
+// Owned by one IPCThreadState; only that thread records into it. A thread
+// has room for kSlotCount distinct (side, target, code) keys; a slot holds
+// three histograms, about 3.8 KB, and is only allocated the first time its
+// key is recorded, so a thread costs at most about 245 KB. Slots are never
+// evicted: once all are taken, recordings of new keys are dropped, logged
+// once per thread, and counted in droppedCount().
+class TransactionStatsRecorder
+{
+public:
+                            TransactionStatsRecorder();
+                            ~TransactionStatsRecorder();
+
+            void            record(TransactionStats::Side side, uintptr_t target,
+                                   uint32_t code, const Parcel& request,
+                                   uint64_t latencyNs, size_t replySize);
+
+    struct Slot;
+
+            // Two-step form of record(), for a request that may be released
+            // before the call completes: the slot is looked up while the
+            // request can still be read. A null slot counts as dropped.
+            Slot*           findSlot(TransactionStats::Side side, uintptr_t target,
+                                     uint32_t code, const Parcel& request);
+            void            record(Slot* slot, size_t requestBytes, uint64_t latencyNs,
+                                   size_t replySize);
+
+private:
+    friend class TransactionStats;
+            void            collect(std::vector<TransactionStats::Entry>* entries) const;
+
+    static constexpr size_t kSlotCount = 64;
+
+            std::atomic<Slot*> mSlots[kSlotCount];
+            std::atomic<uint64_t> mDropped;
+};
+
+} // namespace hardware
+} // namespace android
+
+// ---------------------------------------------------------------------------
+
+#endif // ANDROID_HARDWARE_TRANSACTION_STATS_H
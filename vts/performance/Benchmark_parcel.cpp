@@ -0,0 +1,661 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "libhwbinder_parcel_benchmark"
+
+// Microbenchmarks of the Parcel marshalling primitives. None of them touch
+// the binder driver: parcels are written and read back in-process, where
+// buffer objects still point at the writer's memory, so the numbers only
+// reflect the cost of libhwbinder itself.
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <cutils/native_handle.h>
+#include <hwbinder/Parcel.h>
+#include <utils/String16.h>
+
+// libutils:
+using android::OK;
+using android::status_t;
+using android::String16;
+
+// libhwbinder:
+using android::hardware::Parcel;
+
+// Standard library
+using std::vector;
+
+static void skipOnError(benchmark::State& state, status_t status, const char* what) {
+    if (status != OK) {
+        state.SkipWithError(what);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Scalars
+
+template <typename T, status_t (Parcel::*Write)(T)>
+static void BM_writeScalar(benchmark::State& state) {
+    const size_t count = state.range(0);
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        for (size_t i = 0; i < count; i++) {
+            (parcel.*Write)(static_cast<T>(i));
+        }
+        benchmark::DoNotOptimize(parcel.data());
+    }
+    state.SetBytesProcessed(state.iterations() * count * sizeof(T));
+}
+
+template <typename T, status_t (Parcel::*Write)(T), status_t (Parcel::*Read)(T*) const>
+static void BM_readScalar(benchmark::State& state) {
+    const size_t count = state.range(0);
+    Parcel parcel;
+    for (size_t i = 0; i < count; i++) {
+        (parcel.*Write)(static_cast<T>(i));
+    }
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        for (size_t i = 0; i < count; i++) {
+            T value;
+            (parcel.*Read)(&value);
+            benchmark::DoNotOptimize(value);
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * count * sizeof(T));
+}
+
+#define PARCEL_SCALAR_BENCHMARKS(type, name)                                             \
+    BENCHMARK_TEMPLATE(BM_writeScalar, type, &Parcel::write##name)                       \
+        ->RangeMultiplier(8)->Range(1, 4096);                                            \
+    BENCHMARK_TEMPLATE(BM_readScalar, type, &Parcel::write##name, &Parcel::read##name)   \
+        ->RangeMultiplier(8)->Range(1, 4096)
+
+PARCEL_SCALAR_BENCHMARKS(int8_t, Int8);
+PARCEL_SCALAR_BENCHMARKS(uint8_t, Uint8);
+PARCEL_SCALAR_BENCHMARKS(int16_t, Int16);
+PARCEL_SCALAR_BENCHMARKS(uint16_t, Uint16);
+PARCEL_SCALAR_BENCHMARKS(int32_t, Int32);
+PARCEL_SCALAR_BENCHMARKS(uint32_t, Uint32);
+PARCEL_SCALAR_BENCHMARKS(int64_t, Int64);
+PARCEL_SCALAR_BENCHMARKS(uint64_t, Uint64);
+PARCEL_SCALAR_BENCHMARKS(float, Float);
+PARCEL_SCALAR_BENCHMARKS(double, Double);
+PARCEL_SCALAR_BENCHMARKS(bool, Bool);
+
+// ---------------------------------------------------------------------------
+// Fixed-layout structs
+
+// Shaped like a sensor event: a handful of scalars and a small array.
+struct Event {
+    int32_t version;
+    int32_t sensor;
+    int32_t type;
+    int32_t reserved;
+    int64_t timestamp;
+    float data[16];
+};
+
+static Event makeEvent(size_t i) {
+    Event event = {};
+    event.sensor = i;
+    event.timestamp = i * 1000;
+    for (size_t j = 0; j < 16; j++) {
+        event.data[j] = i + j;
+    }
+    return event;
+}
+
+// What generated code does today.
+static void writeEventFields(Parcel* parcel, const Event& event) {
+    parcel->writeInt32(event.version);
+    parcel->writeInt32(event.sensor);
+    parcel->writeInt32(event.type);
+    parcel->writeInt32(event.reserved);
+    parcel->writeInt64(event.timestamp);
+    for (float value : event.data) {
+        parcel->writeFloat(value);
+    }
+}
+
+static void BM_writeEventFieldByField(benchmark::State& state) {
+    const size_t count = state.range(0);
+    const Event event = makeEvent(1);
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        for (size_t i = 0; i < count; i++) {
+            writeEventFields(&parcel, event);
+        }
+        benchmark::DoNotOptimize(parcel.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_writeEventFieldByField)->RangeMultiplier(8)->Range(1, 512);
+
+static void BM_writePod(benchmark::State& state) {
+    const size_t count = state.range(0);
+    const Event event = makeEvent(1);
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        for (size_t i = 0; i < count; i++) {
+            parcel.writePod(event);
+        }
+        benchmark::DoNotOptimize(parcel.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_writePod)->RangeMultiplier(8)->Range(1, 512);
+
+static void BM_writeFields(benchmark::State& state) {
+    const size_t count = state.range(0);
+    const Event event = makeEvent(1);
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        for (size_t i = 0; i < count; i++) {
+            parcel.writeFields(event.version, event.sensor, event.type, event.reserved,
+                               event.timestamp, event.data);
+        }
+        benchmark::DoNotOptimize(parcel.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_writeFields)->RangeMultiplier(8)->Range(1, 512);
+
+static void BM_readPod(benchmark::State& state) {
+    const size_t count = state.range(0);
+    Parcel parcel;
+    for (size_t i = 0; i < count; i++) {
+        parcel.writePod(makeEvent(i));
+    }
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        for (size_t i = 0; i < count; i++) {
+            Event event;
+            parcel.readPod(&event);
+            benchmark::DoNotOptimize(event);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_readPod)->RangeMultiplier(8)->Range(1, 512);
+
+// Event without its 64-bit field, which readPodInplace() can't point at in
+// 4-byte aligned parcel data.
+struct Sample {
+    int32_t sensor;
+    int32_t type;
+    float data[16];
+};
+
+static void BM_readPodInplace(benchmark::State& state) {
+    const size_t count = state.range(0);
+    Parcel parcel;
+    for (size_t i = 0; i < count; i++) {
+        const Event event = makeEvent(i);
+        Sample sample = { event.sensor, event.type, {} };
+        memcpy(sample.data, event.data, sizeof(sample.data));
+        parcel.writePod(sample);
+    }
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        for (size_t i = 0; i < count; i++) {
+            benchmark::DoNotOptimize(parcel.readPodInplace<Sample>());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_readPodInplace)->RangeMultiplier(8)->Range(1, 512);
+
+// ---------------------------------------------------------------------------
+// Flat data and strings
+
+// Grows an empty parcel through continueWrite() in one write.
+static void BM_write(benchmark::State& state) {
+    vector<uint8_t> payload(state.range(0), 0xAB);
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        parcel.write(payload.data(), payload.size());
+        benchmark::DoNotOptimize(parcel.data());
+    }
+    state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK(BM_write)->RangeMultiplier(4)->Range(4, 1 << 20);
+
+// Same payload, grown through many small writes.
+static void BM_writeIncremental(benchmark::State& state) {
+    const size_t words = state.range(0) / sizeof(uint32_t);
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        for (size_t i = 0; i < words; i++) {
+            parcel.writeUint32(i);
+        }
+        benchmark::DoNotOptimize(parcel.data());
+    }
+    state.SetBytesProcessed(state.iterations() * words * sizeof(uint32_t));
+}
+BENCHMARK(BM_writeIncremental)->RangeMultiplier(4)->Range(4, 1 << 20);
+
+static void BM_writeReserved(benchmark::State& state) {
+    const size_t words = state.range(0) / sizeof(uint32_t);
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        parcel.reserve(words * sizeof(uint32_t), 0);
+        for (size_t i = 0; i < words; i++) {
+            parcel.writeUint32(i);
+        }
+        benchmark::DoNotOptimize(parcel.data());
+    }
+    state.SetBytesProcessed(state.iterations() * words * sizeof(uint32_t));
+}
+BENCHMARK(BM_writeReserved)->RangeMultiplier(4)->Range(4, 1 << 20);
+
+static void BM_read(benchmark::State& state) {
+    vector<uint8_t> payload(state.range(0), 0xAB);
+    vector<uint8_t> out(payload.size());
+    Parcel parcel;
+    parcel.write(payload.data(), payload.size());
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        parcel.read(out.data(), out.size());
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK(BM_read)->RangeMultiplier(4)->Range(4, 1 << 20);
+
+static void BM_readInplace(benchmark::State& state) {
+    vector<uint8_t> payload(state.range(0), 0xAB);
+    Parcel parcel;
+    parcel.write(payload.data(), payload.size());
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        benchmark::DoNotOptimize(parcel.readInplace(payload.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * payload.size());
+}
+BENCHMARK(BM_readInplace)->RangeMultiplier(4)->Range(4, 1 << 20);
+
+// range(0) floats, e.g. a block of audio samples.
+static void BM_writeFloatArray(benchmark::State& state) {
+    vector<float> samples(state.range(0), 0.5f);
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        skipOnError(state, parcel.writeFloatArray(samples.data(), samples.size()),
+                    "writeFloatArray failed");
+        benchmark::DoNotOptimize(parcel.data());
+    }
+    state.SetBytesProcessed(state.iterations() * samples.size() * sizeof(float));
+}
+BENCHMARK(BM_writeFloatArray)->RangeMultiplier(8)->Range(1, 1 << 16);
+
+static void BM_readFloatArray(benchmark::State& state) {
+    vector<float> samples(state.range(0), 0.5f);
+    Parcel parcel;
+    parcel.writeFloatArray(samples.data(), samples.size());
+    vector<float> out;
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        skipOnError(state, parcel.readFloatArray(&out), "readFloatArray failed");
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * samples.size() * sizeof(float));
+}
+BENCHMARK(BM_readFloatArray)->RangeMultiplier(8)->Range(1, 1 << 16);
+
+static void BM_readFloatArrayInplace(benchmark::State& state) {
+    vector<float> samples(state.range(0), 0.5f);
+    Parcel parcel;
+    parcel.writeFloatArray(samples.data(), samples.size());
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        size_t count;
+        benchmark::DoNotOptimize(parcel.readFloatArrayInplace(&count));
+    }
+    state.SetBytesProcessed(state.iterations() * samples.size() * sizeof(float));
+}
+BENCHMARK(BM_readFloatArrayInplace)->RangeMultiplier(8)->Range(1, 1 << 16);
+
+static void BM_writeCString(benchmark::State& state) {
+    std::string str(state.range(0), 'x');
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        parcel.writeCString(str.c_str());
+        benchmark::DoNotOptimize(parcel.data());
+    }
+    state.SetBytesProcessed(state.iterations() * str.size());
+}
+BENCHMARK(BM_writeCString)->RangeMultiplier(4)->Range(4, 4096);
+
+static void BM_readCString(benchmark::State& state) {
+    std::string str(state.range(0), 'x');
+    Parcel parcel;
+    parcel.writeCString(str.c_str());
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        benchmark::DoNotOptimize(parcel.readCString());
+    }
+    state.SetBytesProcessed(state.iterations() * str.size());
+}
+BENCHMARK(BM_readCString)->RangeMultiplier(4)->Range(4, 4096);
+
+static void BM_writeString16(benchmark::State& state) {
+    String16 str(std::string(state.range(0), 'x').c_str());
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        parcel.writeString16(str);
+        benchmark::DoNotOptimize(parcel.data());
+    }
+    state.SetBytesProcessed(state.iterations() * str.size() * sizeof(char16_t));
+}
+BENCHMARK(BM_writeString16)->RangeMultiplier(4)->Range(4, 4096);
+
+static void BM_readString16(benchmark::State& state) {
+    String16 str(std::string(state.range(0), 'x').c_str());
+    Parcel parcel;
+    parcel.writeString16(str);
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        size_t len;
+        benchmark::DoNotOptimize(parcel.readString16Inplace(&len));
+    }
+    state.SetBytesProcessed(state.iterations() * str.size() * sizeof(char16_t));
+}
+BENCHMARK(BM_readString16)->RangeMultiplier(4)->Range(4, 4096);
+
+// ---------------------------------------------------------------------------
+// Scatter-gather buffers
+
+// range(0) top-level buffers of range(1) bytes each.
+static void BM_writeBuffer(benchmark::State& state) {
+    const size_t count = state.range(0);
+    vector<uint8_t> payload(state.range(1), 0xCD);
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        for (size_t i = 0; i < count; i++) {
+            size_t handle;
+            parcel.writeBuffer(payload.data(), payload.size(), &handle);
+        }
+        benchmark::DoNotOptimize(parcel.data());
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_writeBuffer)->RangeMultiplier(4)->Ranges({{1, 256}, {64, 65536}});
+
+static void BM_readBuffer(benchmark::State& state) {
+    const size_t count = state.range(0);
+    vector<uint8_t> payload(state.range(1), 0xCD);
+    Parcel parcel;
+    for (size_t i = 0; i < count; i++) {
+        size_t handle;
+        skipOnError(state, parcel.writeBuffer(payload.data(), payload.size(), &handle),
+                     "writeBuffer failed");
+    }
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        for (size_t i = 0; i < count; i++) {
+            size_t handle;
+            const void* buffer;
+            parcel.readBuffer(payload.size(), &handle, &buffer);
+            benchmark::DoNotOptimize(buffer);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_readBuffer)->RangeMultiplier(4)->Ranges({{1, 256}, {64, 65536}});
+
+// A tree of embedded buffers, range(0) levels deep and range(1) children
+// wide, shaped like nested hidl_vecs. Every node is an array of child
+// pointers, as the parent of an embedded buffer must hold its address.
+class BufferTree {
+public:
+    BufferTree(size_t depth, size_t width) : mWidth(width) {
+        size_t levelSize = 1;
+        for (size_t level = 0; level < depth; level++) {
+            mLevels.emplace_back(levelSize * width, nullptr);
+            levelSize *= width;
+        }
+        // Point every slot at its child node; the last level stays null.
+        for (size_t level = 0; level + 1 < mLevels.size(); level++) {
+            for (size_t i = 0; i < mLevels[level].size(); i++) {
+                mLevels[level][i] = &mLevels[level + 1][i * width];
+            }
+        }
+    }
+
+    size_t nodeSize() const { return mWidth * sizeof(void*); }
+    size_t nodeCount() const {
+        size_t count = 0;
+        for (const auto& level : mLevels) count += level.size() / mWidth;
+        return count;
+    }
+
+    status_t write(Parcel* parcel) const {
+        size_t root;
+        status_t status = parcel->writeBuffer(mLevels[0].data(), nodeSize(), &root);
+        if (status != OK) return status;
+        return writeChildren(parcel, 0, 0, root);
+    }
+
+    status_t read(const Parcel& parcel) const {
+        size_t root;
+        const void* buffer;
+        status_t status = parcel.readBuffer(nodeSize(), &root, &buffer);
+        if (status != OK) return status;
+        return readChildren(parcel, 0, 0, root);
+    }
+
+    // The node at index in level can be found by address in the parcel.
+    const void* node(size_t level, size_t index) const {
+        return &mLevels[level][index * mWidth];
+    }
+
+private:
+    status_t writeChildren(Parcel* parcel, size_t level, size_t node, size_t handle) const {
+        if (level + 1 >= mLevels.size()) return OK;
+        for (size_t i = 0; i < mWidth; i++) {
+            const size_t child = node * mWidth + i;
+            size_t childHandle;
+            status_t status = parcel->writeEmbeddedBuffer(
+                    &mLevels[level + 1][child * mWidth], nodeSize(), &childHandle,
+                    handle, i * sizeof(void*));
+            if (status != OK) return status;
+            status = writeChildren(parcel, level + 1, child, childHandle);
+            if (status != OK) return status;
+        }
+        return OK;
+    }
+
+    status_t readChildren(const Parcel& parcel, size_t level, size_t node,
+                          size_t handle) const {
+        if (level + 1 >= mLevels.size()) return OK;
+        for (size_t i = 0; i < mWidth; i++) {
+            const size_t child = node * mWidth + i;
+            size_t childHandle;
+            const void* buffer;
+            status_t status = parcel.readEmbeddedBuffer(nodeSize(), &childHandle, handle,
+                                                        i * sizeof(void*), &buffer);
+            if (status != OK) return status;
+            status = readChildren(parcel, level + 1, child, childHandle);
+            if (status != OK) return status;
+        }
+        return OK;
+    }
+
+    const size_t mWidth;
+    vector<vector<void*>> mLevels;
+};
+
+static void treeArguments(benchmark::internal::Benchmark* b) {
+    for (int depth = 1; depth <= 4; depth++) {
+        for (int width = 1; width <= 8; width *= 2) {
+            b->Args({depth, width});
+        }
+    }
+}
+
+static void BM_writeEmbeddedBuffers(benchmark::State& state) {
+    BufferTree tree(state.range(0), state.range(1));
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        skipOnError(state, tree.write(&parcel), "writing buffer tree failed");
+        benchmark::DoNotOptimize(parcel.data());
+    }
+    state.SetItemsProcessed(state.iterations() * tree.nodeCount());
+}
+BENCHMARK(BM_writeEmbeddedBuffers)->Apply(treeArguments);
+
+static void BM_readEmbeddedBuffers(benchmark::State& state) {
+    BufferTree tree(state.range(0), state.range(1));
+    Parcel parcel;
+    skipOnError(state, tree.write(&parcel), "writing buffer tree failed");
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        skipOnError(state, tree.read(parcel), "reading buffer tree failed");
+    }
+    state.SetItemsProcessed(state.iterations() * tree.nodeCount());
+}
+BENCHMARK(BM_readEmbeddedBuffers)->Apply(treeArguments);
+
+// Looks up every node of the tree by address, as hidl_vec serialization does.
+static void BM_findBuffer(benchmark::State& state) {
+    const size_t depth = state.range(0);
+    const size_t width = state.range(1);
+    BufferTree tree(depth, width);
+    Parcel parcel;
+    skipOnError(state, tree.write(&parcel), "writing buffer tree failed");
+    size_t lookups = 0;
+    while (state.KeepRunning()) {
+        size_t levelSize = 1;
+        for (size_t level = 0; level < depth; level++) {
+            for (size_t i = 0; i < levelSize; i++) {
+                bool found;
+                size_t handle;
+                size_t offset;
+                parcel.findBuffer(tree.node(level, i), tree.nodeSize(), &found, &handle,
+                                  &offset);
+                benchmark::DoNotOptimize(found);
+                lookups++;
+            }
+            levelSize *= width;
+        }
+    }
+    state.SetItemsProcessed(lookups);
+}
+BENCHMARK(BM_findBuffer)->Apply(treeArguments);
+
+static void BM_quickFindBuffer(benchmark::State& state) {
+    const size_t depth = state.range(0);
+    const size_t width = state.range(1);
+    BufferTree tree(depth, width);
+    Parcel parcel;
+    skipOnError(state, tree.write(&parcel), "writing buffer tree failed");
+    size_t lookups = 0;
+    while (state.KeepRunning()) {
+        size_t levelSize = 1;
+        for (size_t level = 0; level < depth; level++) {
+            for (size_t i = 0; i < levelSize; i++) {
+                size_t handle;
+                benchmark::DoNotOptimize(parcel.quickFindBuffer(tree.node(level, i), &handle));
+                lookups++;
+            }
+            levelSize *= width;
+        }
+    }
+    state.SetItemsProcessed(lookups);
+}
+BENCHMARK(BM_quickFindBuffer)->Apply(treeArguments);
+
+// ---------------------------------------------------------------------------
+// Native handles
+
+// A handle with range(0) fds and range(1) ints. The fds all refer to the
+// same open file; NoDup marshalling never touches them.
+class NativeHandleHolder {
+public:
+    NativeHandleHolder(int numFds, int numInts)
+        : mFd(open("/dev/null", O_RDONLY | O_CLOEXEC)),
+          mHandle(native_handle_create(numFds, numInts)) {
+        for (int i = 0; i < numFds; i++) mHandle->data[i] = mFd;
+        for (int i = 0; i < numInts; i++) mHandle->data[numFds + i] = i;
+    }
+    ~NativeHandleHolder() {
+        native_handle_delete(mHandle);
+        if (mFd >= 0) close(mFd);
+    }
+    const native_handle_t* get() const { return mHandle; }
+
+private:
+    const int mFd;
+    native_handle_t* const mHandle;
+};
+
+static void nativeHandleArguments(benchmark::internal::Benchmark* b) {
+    for (int fds = 0; fds <= 16; fds = fds == 0 ? 1 : fds * 4) {
+        for (int ints = 0; ints <= 64; ints = ints == 0 ? 1 : ints * 8) {
+            b->Args({fds, ints});
+        }
+    }
+}
+
+static void BM_writeNativeHandleNoDup(benchmark::State& state) {
+    NativeHandleHolder handle(state.range(0), state.range(1));
+    while (state.KeepRunning()) {
+        Parcel parcel;
+        skipOnError(state, parcel.writeNativeHandleNoDup(handle.get()),
+                     "writeNativeHandleNoDup failed");
+        benchmark::DoNotOptimize(parcel.data());
+    }
+}
+BENCHMARK(BM_writeNativeHandleNoDup)->Apply(nativeHandleArguments);
+
+static void BM_readNativeHandleNoDup(benchmark::State& state) {
+    NativeHandleHolder handle(state.range(0), state.range(1));
+    Parcel parcel;
+    skipOnError(state, parcel.writeNativeHandleNoDup(handle.get()),
+                 "writeNativeHandleNoDup failed");
+    while (state.KeepRunning()) {
+        parcel.setDataPosition(0);
+        const native_handle_t* out;
+        parcel.readNativeHandleNoDup(&out);
+        benchmark::DoNotOptimize(out);
+    }
+}
+BENCHMARK(BM_readNativeHandleNoDup)->Apply(nativeHandleArguments);
+
+// ---------------------------------------------------------------------------
+// Whole parcels
+
+// Deep copy of a parcel holding a buffer tree, as a queued oneway call does.
+static void BM_copyFrom(benchmark::State& state) {
+    BufferTree tree(state.range(0), state.range(1));
+    Parcel parcel;
+    skipOnError(state, tree.write(&parcel), "writing buffer tree failed");
+    while (state.KeepRunning()) {
+        Parcel copy;
+        skipOnError(state, copy.copyFrom(parcel), "copyFrom failed");
+        benchmark::DoNotOptimize(copy.data());
+    }
+    state.SetItemsProcessed(state.iterations() * tree.nodeCount());
+}
+BENCHMARK(BM_copyFrom)->Apply(treeArguments);
+
+BENCHMARK_MAIN();
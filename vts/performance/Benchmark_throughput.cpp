@@ -15,10 +15,12 @@
  */
 #define LOG_TAG "HwbinderThroughputTest"
 
+#include <sched.h>
 #include <unistd.h>
 #include <sys/wait.h>
 
 #include <cstring>
+#include <iomanip>
 #include <iostream>
 #include <string>
 #include <tuple>
@@ -27,7 +29,13 @@
 #include <log/log.h>
 
 #include <android/hardware/tests/libhwbinder/1.0/IBenchmark.h>
+#include <hidl/HidlBinderSupport.h>
 #include <hidl/HidlSupport.h>
+#include <hwbinder/Parcel.h>
+#include <hwbinder/ProcessState.h>
+#include <hwbinder/TransactionStats.h>
+
+#include "PerfTest.h"
 
 using namespace std;
 using namespace android;
@@ -44,138 +52,101 @@ do { \
     } \
 } while (0)
 
-class Pipe {
-    int m_readFd;
-    int m_writeFd;
-    Pipe(int readFd, int writeFd)
-            : m_readFd{readFd}, m_writeFd{writeFd} {
-    }
-    Pipe(const Pipe &) = delete;
-    Pipe& operator=(const Pipe &) = delete;
-    Pipe& operator=(const Pipe &&) = delete;
- public:
-    Pipe(Pipe&& rval) noexcept {
-        m_readFd = rval.m_readFd;
-        m_writeFd = rval.m_writeFd;
-        rval.m_readFd = 0;
-        rval.m_writeFd = 0;
-    }
-    ~Pipe() {
-        if (m_readFd)
-            close(m_readFd);
-        if (m_writeFd)
-            close(m_writeFd);
-    }
-    void signal() {
-        bool val = true;
-        int error = write(m_writeFd, &val, sizeof(val));
-        ASSERT_TRUE(error >= 0);
-    }
-    void wait() {
-        bool val = false;
-        int error = read(m_readFd, &val, sizeof(val));
-        ASSERT_TRUE(error >= 0);
-    }
-    template<typename T> void send(const T& v) {
-        int error = write(m_writeFd, &v, sizeof(T));
-        ASSERT_TRUE(error >= 0);
-    }
-    template<typename T> void recv(T& v) {
-        int error = read(m_readFd, &v, sizeof(T));
-        ASSERT_TRUE(error >= 0);
-    }
-    static tuple<Pipe, Pipe> createPipePair() {
-        int a[2];
-        int b[2];
+// sendVec() is the first method of IBenchmark, so its transaction code is
+// the first one HIDL hands out.
+static const uint32_t kSendVecTransaction = 1;
 
-        int error1 = pipe(a);
-        int error2 = pipe(b);
-        ASSERT_TRUE(error1 >= 0);
-        ASSERT_TRUE(error2 >= 0);
+// How often a oneway call refused for lack of async buffer space is tried
+// again before it counts as failed.
+static const int kMaxOnewayRetries = 10000;
 
-        return make_tuple(Pipe(a[0], b[1]), Pipe(b[0], a[1]));
-    }
+// One point of the sweep.
+struct RunConfig {
+    int clients;
+    int server_threads;
+    int payload;
+    bool oneway;
 };
 
-static const uint32_t num_buckets = 128;
-static const uint64_t max_time_bucket = 50ull * 1000000;
-static const uint64_t time_per_bucket = max_time_bucket / num_buckets;
-static constexpr float time_per_bucket_ms = time_per_bucket / 1.0E6;
-
-struct ProcResults {
-    uint64_t m_best = max_time_bucket;
-    uint64_t m_worst = 0;
-    uint32_t m_buckets[num_buckets] = {0};
-    uint64_t m_transactions = 0;
-    uint64_t m_total_time = 0;
-
-    // Add a new latency data point and update the aggregation info
-    // e.g. best/worst/total_time.
-    void add_time(uint64_t time) {
-        m_buckets[min(time, max_time_bucket - 1) / time_per_bucket] += 1;
-        m_best = min(time, m_best);
-        m_worst = max(time, m_worst);
-        m_transactions += 1;
-        m_total_time += time;
-    }
-    // Combine two sets of latency data points and update the aggregation info.
-    static ProcResults combine(const ProcResults& a, const ProcResults& b) {
-        ProcResults ret;
-        for (uint32_t i = 0; i < num_buckets; i++) {
-            ret.m_buckets[i] = a.m_buckets[i] + b.m_buckets[i];
-        }
-        ret.m_worst = max(a.m_worst, b.m_worst);
-        ret.m_best = min(a.m_best, b.m_best);
-        ret.m_transactions = a.m_transactions + b.m_transactions;
-        ret.m_total_time = a.m_total_time + b.m_total_time;
-        return ret;
+// Sent from each worker to the master when its run is over.
+struct WorkerResults {
+    // A plain struct, so that it can go through a Pipe as is.
+    TransactionStats::Histogram latency;
+    uint64_t failed = 0;
+    uint64_t retries = 0;  // oneway calls retried while the async space was full
+};
+
+static vector<int> parse_list(const char* arg) {
+    vector<int> values;
+    const char* p = arg;
+    while (*p) {
+        char* end;
+        values.push_back(strtol(p, &end, 0));
+        ASSERT_TRUE(end != p);
+        p = (*end == ',') ? end + 1 : end;
     }
-    // Calculate and report the final aggregated results.
-    void dump() {
-        double best = (double) m_best / 1.0E6;
-        double worst = (double) m_worst / 1.0E6;
-        double average = (double) m_total_time / m_transactions / 1.0E6;
-        cout << "average:"
-             << average
-             << "ms worst:"
-             << worst
-             << "ms best:"
-             << best
-             << "ms"
-             << endl;
-
-        uint64_t cur_total = 0;
-        for (uint32_t i = 0; i < num_buckets; i++) {
-            float cur_time = time_per_bucket_ms * i + 0.5f * time_per_bucket_ms;
-            if ((cur_total < 0.5f * m_transactions)
-                && (cur_total + m_buckets[i] >= 0.5f * m_transactions)) {
-                cout << "50%: " << cur_time << " ";
-            }
-            if ((cur_total < 0.9f * m_transactions)
-                && (cur_total + m_buckets[i] >= 0.9f * m_transactions)) {
-                cout << "90%: " << cur_time << " ";
-            }
-            if ((cur_total < 0.95f * m_transactions)
-                && (cur_total + m_buckets[i] >= 0.95f * m_transactions)) {
-                cout << "95%: " << cur_time << " ";
-            }
-            if ((cur_total < 0.99f * m_transactions)
-                && (cur_total + m_buckets[i] >= 0.99f * m_transactions)) {
-                cout << "99%: " << cur_time << " ";
-            }
-            cur_total += m_buckets[i];
-        }
-        cout << endl;
+    ASSERT_TRUE(!values.empty());
+    return values;
+}
 
+// Dumps count, avg, max and p50/p90/p99/p99.9 in us as json. Percentiles
+// are the lower bounds of their buckets, so they may read up to 25% low.
+static void dump_latency(const TransactionStats::Histogram& h) {
+    double average = h.count ? (double)h.sum / h.count / 1.0E3 : 0;
+    cout << setprecision(5) << "{ \"count\":" << h.count << ", \"avg\":" << average
+         << ", \"max\":" << h.max / 1.0E3 << ", \"p50\":" << h.percentile(50) / 1.0E3
+         << ", \"p90\":" << h.percentile(90) / 1.0E3 << ", \"p99\":" << h.percentile(99) / 1.0E3
+         << ", \"p99.9\":" << h.percentile(99.9) / 1.0E3 << "}";
+}
+
+static void pin_to(const vector<int>& cpus) {
+    if (cpus.empty()) {
+        return;
     }
-};
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    ASSERT_TRUE(sched_setaffinity(0, sizeof(set), &set) == 0);
+}
 
-string generateServiceName(int num) {
-    string serviceName = "hwbinderService" + to_string(num);
+string generateServiceName(int run, int num) {
+    string serviceName = "hwbinderService" + to_string(run) + "_" + to_string(num);
     return serviceName;
 }
 
-void service_fx(const string &serviceName, Pipe p) {
+// Sends the vector the way BpHwBenchmark::sendVec() marshals it, but without
+// waiting for a reply. The stub turns the call down once it sees the oneway
+// flag, so this measures delivery to the server and not the method itself.
+static status_t send_oneway(const sp<IBinder>& binder, const hidl_vec<uint8_t>& vec,
+                            uint64_t* retries) {
+    Parcel data;
+    data.writeInterfaceToken(IBenchmark::descriptor);
+    size_t parent;
+    status_t err = data.writeBuffer(&vec, sizeof(vec), &parent);
+    if (err == OK) {
+        err = data.writeEmbeddedBuffer(vec.data(), vec.size(), nullptr, parent,
+                                       hidl_vec<uint8_t>::kOffsetOfBuffer);
+    }
+    if (err != OK) {
+        return err;
+    }
+    for (int i = 0; i < kMaxOnewayRetries; i++) {
+        err = binder->transact(kSendVecTransaction, data, nullptr, IBinder::FLAG_ONEWAY);
+        if (err != FAILED_TRANSACTION) {
+            return err;
+        }
+        (*retries)++;
+        usleep(10);
+    }
+    return err;
+}
+
+void service_fx(const string &serviceName, int threads, const vector<int>& cpus, Pipe p) {
+    pin_to(cpus);
+    ProcessState::self()->setThreadPoolConfiguration(threads, false /* callerJoinsPool */);
+
     // Start service.
     sp<IBenchmark> server = IBenchmark::getService(serviceName, true);
     ALOGD("Registering %s", serviceName.c_str());
@@ -185,7 +156,8 @@ void service_fx(const string &serviceName, Pipe p) {
         exit(EXIT_FAILURE);
     }
 
-    ALOGD("Starting %s", serviceName.c_str());
+    ALOGD("Starting %s with %d threads", serviceName.c_str(), threads);
+    ProcessState::self()->startThreadPool();
 
     // Signal service started to master and wait to exit.
     p.signal();
@@ -195,20 +167,27 @@ void service_fx(const string &serviceName, Pipe p) {
 
 void worker_fx(
         int num,
+        int run,
+        const RunConfig& config,
         int iterations,
         int service_count,
         bool get_stub,
+        const vector<int>& cpus,
         Pipe p) {
+    if (!cpus.empty()) {
+        pin_to({cpus[num % cpus.size()]});
+    }
     srand(num);
     p.signal();
     p.wait();
 
     // Get references to test services.
     vector<sp<IBenchmark>> workers;
+    vector<sp<IBinder>> binders;
 
     for (int i = 0; i < service_count; i++) {
         sp<IBenchmark> service = IBenchmark::getService(
-                generateServiceName(i), get_stub);
+                generateServiceName(run, i), get_stub);
         ASSERT_TRUE(service != NULL);
         if (get_stub) {
             ASSERT_TRUE(!service->isRemote());
@@ -216,13 +195,17 @@ void worker_fx(
             ASSERT_TRUE(service->isRemote());
         }
         workers.push_back(service);
+        if (config.oneway) {
+            binders.push_back(toBinder<IBenchmark>(service));
+            ASSERT_TRUE(binders.back() != nullptr);
+        }
     }
 
-    ProcResults results;
-    chrono::time_point<chrono::high_resolution_clock> start, end;
+    WorkerResults results;
+    Tick start, end;
     // Prepare data to IPC
     hidl_vec<uint8_t> data_vec;
-    data_vec.resize(16);
+    data_vec.resize(config.payload);
     for (size_t i = 0; i < data_vec.size(); i++) {
         data_vec[i] = i;
     }
@@ -231,31 +214,34 @@ void worker_fx(
         // Randomly pick a service.
         int target = rand() % service_count;
 
-        start = chrono::high_resolution_clock::now();
-        Return<void> ret = workers[target]->sendVec(data_vec, [&](const auto &) {});
-        if (!ret.isOk()) {
-            cout << "thread " << num << " failed status: "
-                << ret.description() << endl;
-            exit(EXIT_FAILURE);
+        bool ok;
+        TICK_NOW(start);
+        if (config.oneway) {
+            ok = send_oneway(binders[target], data_vec, &results.retries) == OK;
+        } else {
+            Return<void> ret = workers[target]->sendVec(data_vec, [&](const auto &) {});
+            ok = ret.isOk();
         }
-        end = chrono::high_resolution_clock::now();
+        TICK_NOW(end);
 
-        uint64_t cur_time = uint64_t(
-               chrono::duration_cast<chrono::nanoseconds>(end - start).count());
-        results.add_time(cur_time);
+        if (ok) {
+            results.latency.add(tickDiffNS(start, end));
+        } else {
+            results.failed++;
+        }
     }
     // Signal completion to master and wait.
     p.signal();
     p.wait();
 
     // Send results to master and wait for go to exit.
-    p.send(results);
+    ASSERT_TRUE(p.send(results) >= 0);
     p.wait();
 
     exit (EXIT_SUCCESS);
 }
 
-Pipe make_service(string service_name) {
+Pipe make_service(string service_name, int threads, const vector<int>& cpus) {
     auto pipe_pair = Pipe::createPipePair();
     pid_t pid = fork();
     if (pid) {
@@ -263,13 +249,14 @@ Pipe make_service(string service_name) {
         return move(get<0>(pipe_pair));
     } else {
         /* child */
-        service_fx(service_name, move(get<1>(pipe_pair)));
+        service_fx(service_name, threads, cpus, move(get<1>(pipe_pair)));
         /* never get here */
         return move(get<0>(pipe_pair));
     }
 }
 
-Pipe make_worker(int num, int iterations, int service_count, bool get_stub) {
+Pipe make_worker(int num, int run, const RunConfig& config, int iterations,
+                 int service_count, bool get_stub, const vector<int>& cpus) {
     auto pipe_pair = Pipe::createPipePair();
     pid_t pid = fork();
     if (pid) {
@@ -277,7 +264,7 @@ Pipe make_worker(int num, int iterations, int service_count, bool get_stub) {
         return move(get<0>(pipe_pair));
     } else {
         /* child */
-        worker_fx(num, iterations, service_count, get_stub,
+        worker_fx(num, run, config, iterations, service_count, get_stub, cpus,
                   move(get<1>(pipe_pair)));
         /* never get here */
         return move(get<0>(pipe_pair));
@@ -296,119 +283,192 @@ void signal_all(vector<Pipe>& v) {
     }
 }
 
-int main(int argc, char *argv[]) {
-    setenv("TREBLE_TESTING_OVERRIDE", "true", true);
-
-    enum HwBinderMode {
-        kBinderize = 0,
-        kPassthrough = 1,
-    };
-    HwBinderMode mode = HwBinderMode::kBinderize;
-
-    // Num of workers.
-    int workers = 2;
-    // Num of services.
-    int services = -1;
-    int iterations = 10000;
+void reap(size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        int status;
+        wait(&status);
+        if (status != 0) {
+            cerr << "nonzero child status" << status << endl;
+        }
+    }
+}
 
+// Runs one point of the sweep and dumps it as a json object.
+void run_config(int run, const RunConfig& config, int iterations, int services,
+                bool get_stub, const vector<int>& client_cpus,
+                const vector<int>& server_cpus) {
     vector<Pipe> worker_pipes;
     vector<Pipe> service_pipes;
 
-    // Parse arguments.
-    for (int i = 1; i < argc; i++) {
-        if (string(argv[i]) == "-m") {
-            if (!strcmp(argv[i + 1], "PASSTHROUGH")) {
-                mode = HwBinderMode::kPassthrough;
-            }
-            i++;
-            continue;
-        }
-        if (string(argv[i]) == "-w") {
-            workers = atoi(argv[i + 1]);
-            i++;
-            continue;
-        }
-        if (string(argv[i]) == "-i") {
-            iterations = atoi(argv[i + 1]);
-            i++;
-            continue;
-        }
-        if (string(argv[i]) == "-s") {
-            services = atoi(argv[i + 1]);
-            i++;
-            continue;
-        }
-    }
-    // If service number is not provided, set it the same as the worker number.
-    if (services == -1) {
-        services = workers;
-    }
-    if (mode == HwBinderMode::kBinderize) {
+    cerr << "run " << run << ": clients " << config.clients << ", server threads "
+         << config.server_threads << ", payload " << config.payload << ", "
+         << (config.oneway ? "oneway delivery" : "two-way") << endl;
+
+    if (!get_stub) {
         // Create services.
-        vector<pid_t> pIds;
         for (int i = 0; i < services; i++) {
-            string serviceName = generateServiceName(i);
-            cout << "creating service: " << serviceName << endl;
-            service_pipes.push_back(make_service(serviceName));
+            service_pipes.push_back(make_service(generateServiceName(run, i),
+                                                 config.server_threads, server_cpus));
         }
         // Wait until all services are up.
         wait_all(service_pipes);
     }
 
     // Create workers (test clients).
-    bool get_stub = mode == HwBinderMode::kBinderize ? false : true;
-    for (int i = 0; i < workers; i++) {
-        worker_pipes.push_back(make_worker(i, iterations, services, get_stub));
+    for (int i = 0; i < config.clients; i++) {
+        worker_pipes.push_back(make_worker(i, run, config, iterations, services, get_stub,
+                                           client_cpus));
     }
     // Wait untill all workers are ready.
     wait_all(worker_pipes);
 
     // Run the workers and wait for completion.
-    chrono::time_point<chrono::high_resolution_clock> start, end;
-    cout << "waiting for workers to complete" << endl;
-    start = chrono::high_resolution_clock::now();
+    Tick start, end;
+    TICK_NOW(start);
     signal_all(worker_pipes);
     wait_all(worker_pipes);
-    end = chrono::high_resolution_clock::now();
-
-    // Calculate overall throughput.
-    double iterations_per_sec = double(iterations * workers)
-        / (chrono::duration_cast < chrono::nanoseconds
-            > (end - start).count() / 1.0E9);
-    cout << "iterations per sec: " << iterations_per_sec << endl;
+    TICK_NOW(end);
 
     // Collect all results from the workers.
-    cout << "collecting results" << endl;
     signal_all(worker_pipes);
-    ProcResults tot_results;
-    for (int i = 0; i < workers; i++) {
-        ProcResults tmp_results;
-        worker_pipes[i].recv(tmp_results);
-        tot_results = ProcResults::combine(tot_results, tmp_results);
+    WorkerResults tot_results;
+    for (int i = 0; i < config.clients; i++) {
+        WorkerResults tmp_results;
+        ASSERT_TRUE(worker_pipes[i].recv(tmp_results) >= 0);
+        tot_results.latency.merge(tmp_results.latency);
+        tot_results.failed += tmp_results.failed;
+        tot_results.retries += tmp_results.retries;
     }
-    tot_results.dump();
 
-    if (mode == HwBinderMode::kBinderize) {
-        // Kill all the services.
-        cout << "killing services" << endl;
-        signal_all(service_pipes);
-        for (int i = 0; i < services; i++) {
-            int status;
-            wait(&status);
-            if (status != 0) {
-                cout << "nonzero child status" << status << endl;
+    // Kill all the services, then all the workers.
+    signal_all(service_pipes);
+    reap(service_pipes.size());
+    signal_all(worker_pipes);
+    reap(worker_pipes.size());
+
+    double seconds = tickDiffNS(start, end) / 1.0E9;
+    cout << (run ? ",\n" : "") << "  { \"clients\":" << config.clients
+         << ", \"services\":" << services
+         << ", \"server_threads\":" << (get_stub ? 0 : config.server_threads)
+         << ", \"payload\":" << config.payload
+         << ", \"oneway\":" << (config.oneway ? "true" : "false")
+         // Oneway calls are refused by the stub before sendVec() runs, so
+         // they only measure delivery to the server.
+         << ", \"mode\":\"" << (config.oneway ? "oneway-delivery" : "two-way") << "\""
+         << ", \"transactions\":" << tot_results.latency.count
+         << ", \"failed\":" << tot_results.failed
+         << ", \"retries\":" << tot_results.retries
+         << ", \"seconds\":" << seconds
+         << ", \"tps\":" << tot_results.latency.count / seconds
+         << ",\n    \"latency_us\":";
+    dump_latency(tot_results.latency);
+    cout << " }";
+    cout.flush();
+}
+
+static void help() {
+    cerr << "usage: hwbinderThroughputTest [options]" << endl;
+    cerr << "Comma-separated lists are swept; every combination is run and dumped" << endl;
+    cerr << "as one element of a json array on stdout." << endl;
+    cerr << "\t-m PASSTHROUGH      : call the implementation in-process" << endl;
+    cerr << "\t-w <list>           : number of client processes (default: 2)" << endl;
+    cerr << "\t-s <n>              : number of services (default: one per client)" << endl;
+    cerr << "\t-t <list>           : thread pool size of each service (default: 1)" << endl;
+    cerr << "\t-p <list>           : payload size in bytes (default: 16)" << endl;
+    cerr << "\t-c twoway|oneway|both : kind of calls (default: twoway); oneway calls" << endl;
+    cerr << "\t                      only measure delivery, the server method is not run" << endl;
+    cerr << "\t-i <n>              : iterations per client (default: 10000)" << endl;
+    cerr << "\t-client_cpus <list> : pin client n to the n-th cpu of the list" << endl;
+    cerr << "\t-server_cpus <list> : pin services to these cpus" << endl;
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    setenv("TREBLE_TESTING_OVERRIDE", "true", true);
+
+    enum HwBinderMode {
+        kBinderize = 0,
+        kPassthrough = 1,
+    };
+    HwBinderMode mode = HwBinderMode::kBinderize;
+
+    // Num of workers.
+    vector<int> workers = {2};
+    // Num of services.
+    int services = -1;
+    vector<int> server_threads = {1};
+    vector<int> payloads = {16};
+    vector<bool> oneway = {false};
+    int iterations = 10000;
+    vector<int> client_cpus;
+    vector<int> server_cpus;
+
+    // Parse arguments.
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (i + 1 >= argc) {
+            help();
+        }
+        const char* value = argv[++i];
+        if (arg == "-m") {
+            if (!strcmp(value, "PASSTHROUGH")) {
+                mode = HwBinderMode::kPassthrough;
+            }
+        } else if (arg == "-w") {
+            workers = parse_list(value);
+        } else if (arg == "-s") {
+            services = atoi(value);
+        } else if (arg == "-t") {
+            server_threads = parse_list(value);
+        } else if (arg == "-p") {
+            payloads = parse_list(value);
+        } else if (arg == "-c") {
+            if (!strcmp(value, "twoway")) {
+                oneway = {false};
+            } else if (!strcmp(value, "oneway")) {
+                oneway = {true};
+            } else if (!strcmp(value, "both")) {
+                oneway = {false, true};
+            } else {
+                help();
             }
+        } else if (arg == "-i") {
+            iterations = atoi(value);
+        } else if (arg == "-client_cpus") {
+            client_cpus = parse_list(value);
+        } else if (arg == "-server_cpus") {
+            server_cpus = parse_list(value);
+        } else {
+            help();
         }
     }
-    // Kill all the workers.
-    cout << "killing workers" << endl;
-    signal_all(worker_pipes);
-    for (int i = 0; i < workers; i++) {
-        int status;
-        wait(&status);
-        if (status != 0) {
-            cout << "nonzero child status" << status << endl;
+
+    bool get_stub = mode == HwBinderMode::kPassthrough;
+    if (get_stub) {
+        // There is neither a thread pool nor a transaction to send oneway.
+        server_threads = {server_threads[0]};
+        if (oneway.back()) {
+            cerr << "oneway calls need binderized mode, skipping them" << endl;
+            oneway = {false};
+        }
+    }
+
+    int run = 0;
+    cout << "[" << endl;
+    for (bool is_oneway : oneway) {
+        for (int payload : payloads) {
+            for (int threads : server_threads) {
+                for (int clients : workers) {
+                    // If service number is not provided, set it the same as the
+                    // worker number.
+                    int service_count = services == -1 ? clients : services;
+                    RunConfig config = {clients, threads, payload, is_oneway};
+                    run_config(run++, config, iterations, service_count, get_stub,
+                               client_cpus, server_cpus);
+                }
+            }
         }
     }
+    cout << endl << "]" << endl;
     return 0;
 }
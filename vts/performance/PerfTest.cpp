@@ -15,6 +15,7 @@
  */
 
 #include "PerfTest.h"
+#include <errno.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -79,6 +80,22 @@ Pipe::~Pipe() {
     }
 }
 
+int Pipe::transfer(int fd, void* buf, size_t size, bool out) {
+    uint8_t* p = static_cast<uint8_t*>(buf);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = out ? write(fd, p + done, size - done) : read(fd, p + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
 Results Results::combine(const Results& a, const Results& b) {
     Results ret;
     for (uint32_t i = 0; i < kNumBuckets; i++) {
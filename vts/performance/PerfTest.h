@@ -16,6 +16,7 @@
 #ifndef HWBINDER_PERF_TEST_H
 #define HWBINDER_PERF_TEST_H
 
+#include <stdint.h>
 #include <unistd.h>
 #include <chrono>
 #include <list>
@@ -45,21 +46,24 @@ class Pipe {
         recv(val);
     }
 
-    // write a data struct
+    // write a data struct; structs larger than PIPE_BUF may take several
+    // writes, and reads, to go through.
     template <typename T>
     int send(const T& v) {
-        return write(fd_write_, &v, sizeof(T));
+        return transfer(fd_write_, const_cast<T*>(&v), sizeof(T), true);
     }
     // read a data struct
     template <typename T>
     int recv(T& v) {
-        return read(fd_read_, &v, sizeof(T));
+        return transfer(fd_read_, &v, sizeof(T), false);
     }
 
    private:
     int fd_read_;   // file descriptor to read
     int fd_write_;  // file descriptor to write
     Pipe(int read_fd, int write_fd) : fd_read_{read_fd}, fd_write_{write_fd} {}
+    // returns the number of bytes transferred, or -1 on error or end of file
+    static int transfer(int fd, void* buf, size_t size, bool out);
     Pipe(const Pipe&) = delete;
     Pipe& operator=(const Pipe&) = delete;
     Pipe& operator=(const Pipe&&) = delete;
@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "hwbinder_replay"
+
+// Sends the transactions of a TransactionRecorder capture to a service
+// again, in the order they were recorded. Records that carry binder objects
+// or file descriptors cannot be reproduced in another process and are
+// skipped.
+
+#include <android/hidl/manager/1.0/IServiceManager.h>
+#include <hidl/HidlBinderSupport.h>
+#include <hidl/ServiceManagement.h>
+#include <hwbinder/IBinder.h>
+#include <hwbinder/Parcel.h>
+#include <hwbinder/TransactionRecorder.h>
+#include <linux/android/binder.h>
+#include <utils/Timers.h>
+
+#include <string.h>
+#include <time.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+using android::BAD_VALUE;
+using android::NO_ERROR;
+using android::OK;
+using android::sp;
+using android::status_t;
+using android::hardware::IBinder;
+using android::hardware::Parcel;
+using android::hardware::TransactionRecorder;
+using android::hidl::base::V1_0::IBase;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+static void help() {
+    cout << "usage: hwbinder_replay <capture> <fqName> [options]" << endl;
+    cout << "\t-instance <name>  : service instance (default: \"default\")" << endl;
+    cout << "\t-direction in|out : replay incoming (default) or outgoing records" << endl;
+    cout << "\t-target <n>       : only records for this handle or node cookie" << endl;
+    cout << "\t-loops <n>        : replay the capture n times (default: 1)" << endl;
+    cout << "\t-timed            : keep the recorded gaps between calls" << endl;
+    exit(EXIT_FAILURE);
+}
+
+// Rebuilds the parcel of a record: the flat data between objects is copied
+// as is and every buffer object is written again, pointing at its captured
+// contents; the driver fixes up the pointers embedded in parent buffers.
+static status_t buildParcel(const TransactionRecorder::Record& record, Parcel* parcel) {
+    const vector<uint8_t>& data = record.data;
+    size_t pos = 0;
+    size_t buffer = 0;
+    for (uint64_t offset : record.objects) {
+        if (offset < pos || offset > data.size() ||
+            data.size() - offset < sizeof(binder_buffer_object)) {
+            return BAD_VALUE;
+        }
+        const binder_buffer_object* obj =
+                reinterpret_cast<const binder_buffer_object*>(data.data() + offset);
+        if (obj->hdr.type != BINDER_TYPE_PTR) {
+            return BAD_VALUE;
+        }
+        if (offset > pos) {
+            status_t err = parcel->write(data.data() + pos, offset - pos);
+            if (err != OK) return err;
+        }
+        if (obj->buffer == 0 || buffer >= record.buffers.size()) {
+            return BAD_VALUE;
+        }
+        const vector<uint8_t>& contents = record.buffers[buffer++];
+        status_t err;
+        if (obj->flags & BINDER_BUFFER_FLAG_HAS_PARENT) {
+            err = parcel->writeEmbeddedBuffer(contents.data(), contents.size(), nullptr,
+                                              obj->parent, obj->parent_offset);
+        } else {
+            err = parcel->writeBuffer(contents.data(), contents.size(), nullptr);
+        }
+        if (err != OK) return err;
+        pos = offset + sizeof(binder_buffer_object);
+    }
+    if (pos < data.size()) {
+        return parcel->write(data.data() + pos, data.size() - pos);
+    }
+    return OK;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        help();
+    }
+    const char* capture = argv[1];
+    const string fqName = argv[2];
+    string instance = "default";
+    TransactionRecorder::Direction direction = TransactionRecorder::INCOMING;
+    bool filterTarget = false;
+    uint64_t target = 0;
+    int loops = 1;
+    bool timed = false;
+
+    for (int i = 3; i < argc; i++) {
+        const string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "-instance" && hasValue) {
+            instance = argv[++i];
+        } else if (arg == "-direction" && hasValue) {
+            const string value = argv[++i];
+            if (value == "in") {
+                direction = TransactionRecorder::INCOMING;
+            } else if (value == "out") {
+                direction = TransactionRecorder::OUTGOING;
+            } else {
+                help();
+            }
+        } else if (arg == "-target" && hasValue) {
+            filterTarget = true;
+            target = strtoull(argv[++i], nullptr, 0);
+        } else if (arg == "-loops" && hasValue) {
+            loops = atoi(argv[++i]);
+        } else if (arg == "-timed") {
+            timed = true;
+        } else {
+            help();
+        }
+    }
+
+    vector<TransactionRecorder::Record> records;
+    status_t err = TransactionRecorder::read(capture, &records);
+    if (err != NO_ERROR) {
+        cerr << "cannot read " << capture << ": " << strerror(-err) << endl;
+        return EXIT_FAILURE;
+    }
+
+    sp<IBase> service = android::hardware::defaultServiceManager()->get(fqName, instance);
+    if (service == nullptr) {
+        cerr << "cannot get " << fqName << "/" << instance << endl;
+        return EXIT_FAILURE;
+    }
+    sp<IBinder> binder = android::hardware::toBinder<IBase>(service);
+    if (binder == nullptr || binder->remoteBinder() == nullptr) {
+        cerr << fqName << "/" << instance << " is not a remote service" << endl;
+        return EXIT_FAILURE;
+    }
+
+    size_t sent = 0;
+    size_t skipped = 0;
+    size_t failed = 0;
+    nsecs_t busyNs = 0;
+    const nsecs_t replayStart = systemTime(SYSTEM_TIME_MONOTONIC);
+    for (int loop = 0; loop < loops; loop++) {
+        nsecs_t firstRecordedNs = -1;
+        const nsecs_t loopStart = systemTime(SYSTEM_TIME_MONOTONIC);
+        for (const TransactionRecorder::Record& record : records) {
+            const TransactionRecorder::RecordHeader& hdr = record.header;
+            if (hdr.direction != direction || (filterTarget && hdr.target != target)) {
+                continue;
+            }
+            Parcel data;
+            if (buildParcel(record, &data) != OK) {
+                skipped++;
+                continue;
+            }
+
+            if (timed) {
+                if (firstRecordedNs < 0) firstRecordedNs = hdr.startNs;
+                const nsecs_t due = loopStart + (nsecs_t)hdr.startNs - firstRecordedNs;
+                const nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+                if (due > now) {
+                    struct timespec ts = {
+                        .tv_sec = (time_t)((due - now) / 1000000000),
+                        .tv_nsec = (long)((due - now) % 1000000000),
+                    };
+                    nanosleep(&ts, nullptr);
+                }
+            }
+
+            Parcel reply;
+            const uint32_t flags = hdr.flags & IBinder::FLAG_ONEWAY;
+            const nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+            status_t status = binder->transact(hdr.code, data, &reply, flags);
+            busyNs += systemTime(SYSTEM_TIME_MONOTONIC) - start;
+            sent++;
+            if (status != OK) failed++;
+        }
+    }
+    const nsecs_t totalNs = systemTime(SYSTEM_TIME_MONOTONIC) - replayStart;
+
+    cout << "records: " << records.size() << ", sent: " << sent << ", skipped: " << skipped
+         << ", failed: " << failed << endl;
+    cout << "total: " << totalNs / 1000 << " us, in calls: " << busyNs / 1000 << " us";
+    if (sent > 0) {
+        cout << ", average: " << busyNs / (nsecs_t)sent / 1000.0 << " us";
+    }
+    cout << endl;
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}